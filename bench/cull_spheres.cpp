@@ -0,0 +1,124 @@
+// Times cull_spheres against the scalar kernel and checks they agree
+// Built with make bench, run as bin/cull_spheres [sphere count]
+
+// internal
+#include "renderer/culling.h"
+
+// external
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+// std
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+// Budget of the SIMD kernel, in milliseconds per million spheres
+constexpr double BUDGET = 1.0;
+constexpr int RUNS = 20;
+
+// Fastest of RUNS, in milliseconds
+template <typename F>
+static double time_best(F&& fn)
+{
+    double best = INFINITY;
+    for (int i = 0; i < RUNS; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+// If a plane touches the sphere's surface (within rounding), the kernels
+// round differently (fma) so they may disagree on these
+static bool on_boundary(const Frustum& frustum, const SphereSoA& spheres,
+    size_t i)
+{
+    for (auto& plane : frustum.planes)
+    {
+        float distance = plane.x * spheres.x[i] + plane.y * spheres.y[i] +
+            plane.z * spheres.z[i] + plane.w + spheres.radius[i];
+        float scale = std::fabs(plane.x * spheres.x[i]) +
+            std::fabs(plane.y * spheres.y[i]) +
+            std::fabs(plane.z * spheres.z[i]) + std::fabs(plane.w) +
+            spheres.radius[i];
+        if (std::fabs(distance) <= scale * 1e-5f) return true;
+    }
+    return false;
+}
+
+int main(int argc, char** argv)
+{
+    size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+
+    // Spheres scattered around a camera looking down -z, about one in seven
+    // of them visible
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> position(-500.0f, 500.0f);
+    std::uniform_real_distribution<float> size(0.1f, 10.0f);
+    SphereSoA spheres;
+    spheres.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        spheres.set(i, position(random), position(random), position(random),
+            size(random));
+    }
+
+    glm::mat4 projection = glm::perspective(glm::radians(90.0f), 16.0f / 9.0f,
+        0.1f, 400.0f);
+    glm::mat4 view = glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+        glm::vec3(0.0f, 1.0f, 0.0f));
+    Frustum frustum = Frustum::from_matrix(projection * view, false);
+
+    std::vector<uint64_t> simd;
+    std::vector<uint64_t> scalar;
+    size_t visible = 0;
+    double simd_time = time_best([&]()
+    {
+        visible = cull_spheres(frustum, spheres, simd);
+    });
+    double scalar_time = time_best([&]()
+    {
+        cull_spheres_scalar(frustum, spheres, scalar);
+    });
+
+    size_t mismatches = 0;
+    size_t boundary = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        bool a = (simd[i / 64] >> (i % 64)) & 1;
+        bool b = (scalar[i / 64] >> (i % 64)) & 1;
+        if (a == b) continue;
+        if (on_boundary(frustum, spheres, i)) boundary++;
+        else mismatches++;
+    }
+
+    double per_million = simd_time * 1000000.0 / std::max<size_t>(count, 1);
+    printf("%zu spheres, %zu visible\n", count, visible);
+    printf("cull_spheres:        %8.3f ms (%.3f ms per million)\n",
+        simd_time, per_million);
+    printf("cull_spheres_scalar: %8.3f ms (%.1fx)\n", scalar_time,
+        scalar_time / simd_time);
+    printf("masks differ on %zu spheres, %zu of them on a plane\n",
+        mismatches + boundary, boundary);
+
+    if (mismatches != 0)
+    {
+        printf("FAILED: the kernels disagree\n");
+        return 1;
+    }
+    if (per_million > BUDGET)
+    {
+        printf("FAILED: over the budget of %.1f ms per million spheres\n",
+            BUDGET);
+        return 1;
+    }
+    return 0;
+}
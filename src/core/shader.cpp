@@ -1,7 +1,9 @@
 #include "shader.h"
 
+// internal
+#include "util/util.h"
+
 // std
-#include <fstream>
 #include <stdexcept>
 
 #define SHADER_DIR "resources/shaders"
@@ -30,30 +32,12 @@ bgfx::ShaderHandle load_shader(const std::string& name)
 
 
     std::string path = std::string(SHADER_DIR) + std::string("/") + type + std::string("/") + name + std::string(".bin");
-    char* data = nullptr;
-    std::ifstream file;
-    size_t size = 0;
-
-    file.open(path);
-    if (file.is_open()) 
-    {
-        file.seekg(0, std::ios::end);
-        size = (size_t) file.tellg() + 1;
-        file.seekg(0, std::ios::beg);
-		data = new char[size];
-        file.read(data, size);
-        file.close();
-    }
-    else
-    {
-    	throw std::runtime_error("Cannot find file " + path);
-    }
 
-    const bgfx::Memory* mem = bgfx::copy(data, size);
-    mem->data[mem->size - 1] = 0;
+    // Referenced straight from the page cache, unmapped once bgfx is done
+    // The code length is part of the binary, so no terminator is needed
+    const bgfx::Memory* mem = read_file_mapped(path);
     bgfx::ShaderHandle handle = bgfx::createShader(mem);
     bgfx::setName(handle, name.c_str());
-	if (data) delete[] data;
     return handle;
 }
 
@@ -32,6 +32,26 @@ bgfx::VertexLayout pos_tex_norm()
     return layout;
 }
 
+// Quantized version of pos_tex_norm (16 bytes instead of 32)
+// Positions are snorm16 in the mesh bounds (the decode matrix is folded into 
+// the model matrix), normals are octahedral snorm16 and uvs are half floats
+bgfx::VertexLayout pos_tex_norm_quantized()
+{
+    static bgfx::VertexLayout layout;
+    static bool initialized = false;
+    if (!initialized)
+    {
+        layout.begin()
+            .add(bgfx::Attrib::Position, 4, bgfx::AttribType::Int16, true)
+            .add(bgfx::Attrib::Normal, 2, bgfx::AttribType::Int16, true)
+            .add(bgfx::Attrib::TexCoord0, 2, bgfx::AttribType::Half)
+            .end();
+        initialized = true;
+    }
+
+    return layout;
+}
+
 bgfx::VertexLayout objs_info_layout(uint8_t count)
 {
     static bgfx::Attrib::Enum texcoords[] = 
@@ -17,12 +17,15 @@ void Global::init()
 {
     window_init("bgfx"); 
     allocator = new bx::DefaultAllocator();
+    jobs = new JobSystem();
     bgfx = new BGFXHandler(get_native_window(), get_native_display(), window_width, window_height, allocator);
     glfwSetKeyCallback((GLFWwindow*) get_window(), key_callback); 
 }
 
 Global::~Global()
 {
+    // Jobs may still be using bgfx
+    delete jobs;
     delete bgfx;
     delete allocator;
 }
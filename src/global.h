@@ -2,6 +2,7 @@
 
 // internal
 #include "core/bgfx_handler.h"
+#include "util/jobs.h"
 #include "util/timer.h"
 #include "core/input/keyboard.h"
 #include "core/input/mouse.h"
@@ -20,6 +21,9 @@ struct Global
 
     bx::AllocatorI* allocator;
 
+    // Shared worker threads, fan work out here instead of starting threads
+    JobSystem* jobs;
+
     void init();
     ~Global();
 };
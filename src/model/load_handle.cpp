@@ -0,0 +1,66 @@
+#include "load_handle.h"
+
+// internal
+#include "global.h"
+
+// std
+#include <exception>
+
+LoadHandle LoadHandle::start(std::function<void()> load,
+    BatchManager* batchmanager, std::function<void()> upload)
+{
+    LoadHandle handle;
+    handle.shared = std::make_shared<Shared>();
+    std::shared_ptr<Shared> shared = handle.shared;
+
+    global->jobs->run([shared, load = std::move(load), batchmanager,
+        upload = std::move(upload)]()
+    {
+        if (shared->state.load() != State::Loading) return;
+
+        try
+        {
+            load();
+        }
+        catch (const std::exception& e)
+        {
+            shared->error = e.what();
+            shared->state = State::Failed;
+            return;
+        }
+
+        // Cancelled while parsing
+        State expected = State::Loading;
+        if (!shared->state.compare_exchange_strong(expected, State::Loaded))
+            return;
+        if (!batchmanager) return;
+
+        batchmanager->queue_upload([shared, upload]()
+        {
+            State expected = State::Loaded;
+            if (!shared->state.compare_exchange_strong(expected,
+                State::Uploaded)) return;
+            upload();
+        });
+    }, &shared->counter);
+
+    return handle;
+}
+
+void LoadHandle::wait() const
+{
+    if (shared) global->jobs->wait(shared->counter);
+}
+
+void LoadHandle::cancel()
+{
+    if (!shared) return;
+
+    State expected = State::Loading;
+    if (!shared->state.compare_exchange_strong(expected, State::Cancelled))
+    {
+        expected = State::Loaded;
+        shared->state.compare_exchange_strong(expected, State::Cancelled);
+    }
+    wait();
+}
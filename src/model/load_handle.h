@@ -0,0 +1,77 @@
+#pragma once
+
+// internal
+#include "renderer/batchmanager.h"
+#include "util/jobs.h"
+
+// std
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+
+// Progress of a mesh loaded in the background (see load_mesh_async)
+// Copies share the same load
+class LoadHandle
+{
+public:
+    enum class State
+    {
+        // Parsing on a worker thread
+        Loading,
+
+        // Parsed, the upload is queued on the batch manager (if it has one)
+        Loaded,
+
+        // In the batches
+        Uploaded,
+
+        Failed,
+        Cancelled
+    };
+private:
+    struct Shared
+    {
+        std::atomic<State> state = State::Loading;
+        std::string error;
+        JobCounter counter;
+    };
+
+    std::shared_ptr<Shared> shared;
+public:
+    LoadHandle() = default;
+
+    // Runs load on the job system. Once it succeeds, upload is queued on the
+    // batch manager (if not nullptr) and runs at the start of its next draw
+    // Exceptions thrown by load fail the handle
+    static LoadHandle start(std::function<void()> load,
+        BatchManager* batchmanager, std::function<void()> upload);
+
+    bool valid() const { return shared != nullptr; }
+    State state() const
+    {
+        return shared ? shared->state.load() : State::Cancelled;
+    }
+    bool loaded() const
+    {
+        return state() == State::Loaded || state() == State::Uploaded;
+    }
+    bool uploaded() const { return state() == State::Uploaded; }
+    bool failed() const { return state() == State::Failed; }
+
+    // Message of the exception that failed the load, empty for a handle
+    // that was never started
+    const std::string& error() const
+    {
+        static const std::string none;
+        return shared ? shared->error : none;
+    }
+
+    // Runs jobs on the calling thread until the parsing is over
+    // The upload still waits for the batch manager
+    void wait() const;
+
+    // Drops the upload if it hasn't happened yet and waits for the parsing,
+    // after which whatever was being loaded into may be destroyed
+    void cancel();
+};
@@ -0,0 +1,129 @@
+#include "lod.h"
+
+// external
+#include <glm/glm.hpp>
+#include <robin-hood/robin-hood.h>
+
+// std
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+#include <set>
+#include <tuple>
+
+static glm::vec3 read_position(const uint8_t* positions, size_t stride,
+    uint32_t index)
+{
+    glm::vec3 position;
+    memcpy(&position, positions + index * stride, sizeof(glm::vec3));
+    return position;
+}
+
+std::vector<uint32_t> simplify_clustering(const uint32_t* indices,
+    size_t index_count, const uint8_t* positions, size_t stride,
+    size_t vertex_count, uint32_t grid_size)
+{
+    grid_size = std::max(grid_size, 1u);
+
+    // Bounds of the vertices that are used
+    glm::vec3 low(FLT_MAX), high(-FLT_MAX);
+    for (size_t i = 0; i < index_count; i++)
+    {
+        glm::vec3 position = read_position(positions, stride, indices[i]);
+        low = glm::min(low, position);
+        high = glm::max(high, position);
+    }
+    glm::vec3 cell_scale = (float) grid_size / glm::max(high - low,
+        glm::vec3(1e-6f));
+
+    // Cell of each used vertex, and the average position of each cell
+    std::vector<uint32_t> cells(vertex_count, UINT32_MAX);
+    robin_hood::unordered_map<uint64_t, uint32_t> cell_ids;
+    std::vector<glm::vec4> averages;
+    for (size_t i = 0; i < index_count; i++)
+    {
+        uint32_t vertex = indices[i];
+        if (cells[vertex] != UINT32_MAX) continue;
+
+        glm::vec3 position = read_position(positions, stride, vertex);
+        glm::vec3 cell = (position - low) * cell_scale;
+        uint64_t key = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            uint64_t coordinate = std::min((uint32_t) cell[axis], grid_size - 1);
+            key = (key << 21) | coordinate;
+        }
+
+        auto [it, inserted] = cell_ids.emplace(key, (uint32_t) averages.size());
+        if (inserted) averages.emplace_back(0.0f);
+        averages[it->second] += glm::vec4(position, 1.0f);
+        cells[vertex] = it->second;
+    }
+
+    // The vertex closest to the average represents the cell
+    std::vector<uint32_t> representatives(averages.size(), UINT32_MAX);
+    std::vector<float> distances(averages.size(), FLT_MAX);
+    for (size_t i = 0; i < index_count; i++)
+    {
+        uint32_t vertex = indices[i];
+        uint32_t cell = cells[vertex];
+        glm::vec3 average = glm::vec3(averages[cell]) / averages[cell].w;
+        glm::vec3 offset = read_position(positions, stride, vertex) - average;
+        float distance = glm::dot(offset, offset);
+        if (distance < distances[cell])
+        {
+            distances[cell] = distance;
+            representatives[cell] = vertex;
+        }
+    }
+
+    // Keeps the first triangle of each set of three collapsed vertices
+    std::vector<uint32_t> result;
+    std::set<std::tuple<uint32_t, uint32_t, uint32_t>> seen;
+    for (size_t i = 0; i + 2 < index_count; i += 3)
+    {
+        uint32_t a = representatives[cells[indices[i]]];
+        uint32_t b = representatives[cells[indices[i + 1]]];
+        uint32_t c = representatives[cells[indices[i + 2]]];
+        if (a == b || b == c || a == c) continue;
+
+        // Rotate the smallest index first, winding stays the same
+        if (b < a && b < c) std::tie(a, b, c) = std::make_tuple(b, c, a);
+        else if (c < a && c < b) std::tie(a, b, c) = std::make_tuple(c, a, b);
+
+        if (!seen.insert({a, b, c}).second) continue;
+        result.insert(result.end(), {a, b, c});
+    }
+
+    return result;
+}
+
+std::vector<uint32_t> simplify(const uint32_t* indices, size_t index_count,
+    const uint8_t* positions, size_t stride, size_t vertex_count,
+    size_t target_count)
+{
+    std::vector<uint32_t> best(indices, indices + index_count);
+    if (index_count <= target_count) return best;
+
+    // Triangles kept grow with the grid size, so binary search it
+    uint32_t low = 1, high = 1024;
+    bool found = false;
+    while (low <= high)
+    {
+        uint32_t grid_size = low + (high - low) / 2;
+        std::vector<uint32_t> result = simplify_clustering(indices,
+            index_count, positions, stride, vertex_count, grid_size);
+
+        if (result.size() > target_count)
+        {
+            high = grid_size - 1;
+            continue;
+        }
+
+        if (!found || result.size() > best.size()) best = std::move(result);
+        found = true;
+        low = grid_size + 1;
+    }
+
+    return best;
+}
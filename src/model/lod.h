@@ -0,0 +1,31 @@
+#pragma once
+
+// std
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// One level of detail, a range of the mesh's index buffer
+// Every level indexes the same vertices, only the triangles differ
+struct MeshLod
+{
+    size_t index_start = 0;
+    size_t index_count = 0;
+
+    // Camera distance (in model space units) from which the level is used
+    float distance = 0.0f;
+};
+
+// Simplifies by vertex clustering, vertices in the same cell of a grid over
+// the bounds collapse into the one closest to the cell's average.
+// Collapsed and duplicate triangles are dropped. Positions are read as 3
+// floats every stride bytes, the result indexes the same vertices
+std::vector<uint32_t> simplify_clustering(const uint32_t* indices,
+    size_t index_count, const uint8_t* positions, size_t stride,
+    size_t vertex_count, uint32_t grid_size);
+
+// Searches for the grid that keeps the most triangles within target_count
+// indices, returns the indices unchanged when they can't be reduced
+std::vector<uint32_t> simplify(const uint32_t* indices, size_t index_count,
+    const uint8_t* positions, size_t stride, size_t vertex_count,
+    size_t target_count);
@@ -1,6 +1,15 @@
 #include "mesh.h"
 
+// internal
+#include "model/quantize.h"
+
+// external
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/packing.hpp>
+
 // std
+#include <algorithm>
+#include <cfloat>
 #include <stdexcept>
 #include <tuple>
 
@@ -26,6 +35,7 @@ void Mesh<Vertex>::load_animation(const std::string& identifier, const std::stri
     uint32_t sizeof_index = 
         data->accessors[3].component_type == cgltf_component_type_r_16u ? 
         sizeof(uint16_t) : sizeof(uint32_t);
+    native_index_size = std::max(native_index_size, sizeof_index);
 
     // Parse buffers into model
     size_t vertices_size = 
@@ -33,6 +43,9 @@ void Mesh<Vertex>::load_animation(const std::string& identifier, const std::stri
          data->buffer_views[2].size) / sizeof(Vertex);
     size_t indices_size = data->buffer_views[3].size / sizeof_index;
 
+    // Frames are appended, their indices are made relative to the mesh
+    size_t vertex_offset = vertices.size();
+    size_t index_offset = indices.size();
     vertices.resize(vertices_size + vertices.size());
     indices.resize(indices_size + indices.size());
 
@@ -46,24 +59,22 @@ void Mesh<Vertex>::load_animation(const std::string& identifier, const std::stri
     
     for (size_t i = 0; i < data->buffer_views[0].size / sizeof(glm::vec3); i++)
     {
-        vertices[i].position = position_pointer[i];
-        vertices[i].uv = uv_pointer[i];
-        vertices[i].normal = normal_pointer[i];
+        vertices[vertex_offset + i].position = position_pointer[i];
+        vertices[vertex_offset + i].uv = uv_pointer[i];
+        vertices[vertex_offset + i].normal = normal_pointer[i];
     }
 
     for (size_t i = 0; i < indices_size; i++)
     {
-        if (sizeof_index == sizeof(uint16_t)) indices[i] = 
-            ((uint16_t*) ((char*) data->buffers->data + 
+        if (sizeof_index == sizeof(uint16_t)) indices[index_offset + i] = 
+            vertex_offset + ((uint16_t*) ((char*) data->buffers->data + 
                 data->buffer_views[3].offset))[i];
-        else indices[i] = 
-            ((uint32_t*) ((char*) data->buffers->data + 
+        else indices[index_offset + i] = 
+            vertex_offset + ((uint32_t*) ((char*) data->buffers->data + 
                 data->buffer_views[3].offset))[i];
     }
 
-    animation_frames[identifier] = 
-        {indices.size() / sizeof(uint32_t) - indices_size / sizeof(uint32_t) - 1, 
-            indices_size / sizeof(uint32_t)};
+    animation_frames[identifier] = {index_offset, indices_size};
 
     cgltf_free(data);
 }
@@ -85,9 +96,12 @@ void Mesh<PosOnly>::load_animation(const std::string& identifier, const std::str
     uint32_t sizeof_index = 
         data->accessors[1].component_type == cgltf_component_type_r_16u ? 
         sizeof(uint16_t) : sizeof(uint32_t);
+    native_index_size = std::max(native_index_size, sizeof_index);
 
     size_t indices_size = data->buffer_views[1].size / sizeof_index;
 
+    size_t vertex_offset = vertices.size();
+    size_t index_offset = indices.size();
     vertices.resize(size + vertices.size());
     indices.resize(indices_size + indices.size());
 
@@ -96,25 +110,72 @@ void Mesh<PosOnly>::load_animation(const std::string& identifier, const std::str
 
     for (size_t i = 0; i < size; i++)
     {
-        vertices[i].position = position_pointer[i];
+        vertices[vertex_offset + i].position = position_pointer[i];
     }
 
     for (size_t i = 0; i < indices_size; i++)
     {
-        if (sizeof_index == sizeof(uint16_t)) indices[i] = 
-            ((uint16_t*) ((char*) data->buffers->data + 
+        if (sizeof_index == sizeof(uint16_t)) indices[index_offset + i] = 
+            vertex_offset + ((uint16_t*) ((char*) data->buffers->data + 
                 data->buffer_views[1].offset))[i];
-        else indices[i] = 
-            ((uint32_t*) ((char*) data->buffers->data + 
+        else indices[index_offset + i] = 
+            vertex_offset + ((uint32_t*) ((char*) data->buffers->data + 
                 data->buffer_views[1].offset))[i];
     }
 
-    animation_frames[identifier] = 
-        {indices.size() / sizeof(uint32_t) - indices_size / sizeof(uint32_t) - 1, 
-            indices_size / sizeof(uint32_t)};
+    animation_frames[identifier] = {index_offset, indices_size};
     cgltf_free(data);
 }
 
+template <>
+void Mesh<Vertex>::quantize()
+{
+    if (vertices.empty()) return;
+
+    // Positions are stored relative to the center of the bounds
+    // The scale is uniform so the decode matrix doesn't skew normals
+    glm::vec3 low(FLT_MAX), high(-FLT_MAX);
+    for (auto& vertex : vertices)
+    {
+        low = glm::min(low, vertex.position);
+        high = glm::max(high, vertex.position);
+    }
+
+    glm::vec3 center = (low + high) * 0.5f;
+    glm::vec3 half_size = (high - low) * 0.5f;
+    float extent = glm::max(glm::max(half_size.x, half_size.y), 
+        glm::max(half_size.z, 1e-6f));
+    decode = glm::scale(glm::translate(glm::mat4(1.0f), center), 
+        glm::vec3(extent));
+
+    // Meshlet bounds are tested against the decoded model matrix
+    for (auto& meshlet : meshlets)
+    {
+        meshlet.center = (meshlet.center - center) / extent;
+        meshlet.radius /= extent;
+    }
+
+    quantized.resize(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++)
+    {
+        glm::vec3 position = (vertices[i].position - center) / extent;
+        glm::vec2 normal = oct_encode(vertices[i].normal);
+        QuantizedVertex& packed = quantized[i];
+
+        packed.position[0] = pack_snorm16(position.x);
+        packed.position[1] = pack_snorm16(position.y);
+        packed.position[2] = pack_snorm16(position.z);
+        packed.position[3] = pack_snorm16(1.0f);
+        packed.normal[0] = pack_snorm16(normal.x);
+        packed.normal[1] = pack_snorm16(normal.y);
+        packed.uv[0] = glm::packHalf1x16(vertices[i].uv.x);
+        packed.uv[1] = glm::packHalf1x16(vertices[i].uv.y);
+    }
+
+    vertices.clear();
+    vertices.shrink_to_fit();
+}
+
 StandardModel::StandardModel()
 {
     // Potentially allow customizable layouts
@@ -122,12 +183,28 @@ StandardModel::StandardModel()
 
 StandardModel::~StandardModel()
 {
+    loading.cancel();
+}
 
+void StandardModel::load_mesh(const std::string& path, 
+    const MeshOptions& options)
+{
+    mesh.load_data(path, options);
 }
 
-void StandardModel::load_mesh(const std::string& path)
+LoadHandle StandardModel::load_mesh_async(const std::string& path, 
+    const MeshOptions& options, BatchManager* batchmanager, 
+    TextureAtlas* atlas)
 {
-    mesh.load_data(path);
+    loading.cancel();
+    loading = LoadHandle::start(
+        [this, path, options]() { mesh.load_data(path, options); }, 
+        batchmanager, [this, batchmanager, atlas]()
+    {
+        if (atlas) load_texture(atlas);
+        upload(batchmanager);
+    });
+    return loading;
 }
 
 void StandardModel::load_texture(TextureAtlas* atlas)
@@ -158,7 +235,8 @@ Buffer<uint8_t> StandardModel::get_model_buffer()
 {
     // Make sure the stride is a multiple of 16 (20 in this case)
     if (model_buffer.size() == 0) model_buffer.resize(16 * sizeof(float) + sizeof(float) * 4);
-    memcpy((void*) model_buffer.data(), (void*) glm::value_ptr(modelmat), 16 * sizeof(float));
+    glm::mat4 mat = modelmat * mesh.get_decode_matrix();
+    memcpy((void*) model_buffer.data(), (void*) glm::value_ptr(mat), 16 * sizeof(float));
     float* tex_id = (float*) (model_buffer.data() + 16 * sizeof(float));
     *tex_id = (float) texture_id;
     return Buffer(model_buffer.data(), model_buffer.size());
@@ -184,7 +262,9 @@ void InstancedModel::upload(BatchManager*)
 {
     if (base->get_batch() == nullptr) return; 
 
-    obj_index = base->get_batch()->add_instance(this, base->get_index()); 
+    if (!get_meshlets().empty()) obj_index = base->get_batch()->add_clusters(
+        this, base->get_index(), get_meshlets());
+    else obj_index = base->get_batch()->add_instance(this, base->get_index()); 
 }
 
 void InstancedModel::set_modelmat(const glm::mat4& mat)
@@ -196,7 +276,8 @@ void InstancedModel::set_modelmat(const glm::mat4& mat)
 Buffer<uint8_t> InstancedModel::get_model_buffer()
 {
     if (model_buffer.size() == 0) model_buffer.resize(16 * sizeof(float) + sizeof(float) * 4);
-    memcpy((void*) model_buffer.data(), (void*) glm::value_ptr(modelmat), 16 * sizeof(float));
+    glm::mat4 mat = modelmat * base->get_decode_matrix();
+    memcpy((void*) model_buffer.data(), (void*) glm::value_ptr(mat), 16 * sizeof(float));
     float* tex_id = (float*) (model_buffer.data() + 16 * sizeof(float));
     *tex_id = (float) base->get_texture_id();
     return Buffer(model_buffer.data(), model_buffer.size());
@@ -3,7 +3,14 @@
 // internal
 #include "texture/texture.h"
 #include "util/buffer.h"
+#include "util/mapped_file.h"
+#include "util/util.h"
 #include "global.h"
+#include "model/load_handle.h"
+#include "model/lod.h"
+#include "model/mesh_cache.h"
+#include "model/mesh_optimizer.h"
+#include "model/meshlet.h"
 #include "renderer/batchmanager.h"
 
 // external
@@ -17,7 +24,9 @@
 #include <robin-hood/robin-hood.h>
 
 // std
+#include <cstdint>
 #include <optional>
+#include <stdexcept>
 #include <string> 
 #include <vector>
 #include <fstream>
@@ -34,6 +43,46 @@ struct PosOnly
     glm::vec3 position;
 };
 
+// Vertex packed for pos_tex_norm_quantized (see model/quantize.h)
+struct QuantizedVertex
+{
+    int16_t position[4];
+    int16_t normal[2];
+    uint16_t uv[2];
+};
+
+// Processing done to a mesh while it is loaded
+struct MeshOptions
+{
+    // Pack the vertices into QuantizedVertex (textured meshes only)
+    // The layout of the batch manager must be pos_tex_norm_quantized
+    bool quantize = false;
+
+    // Reorder triangles for the vertex cache and vertices for fetch locality
+    bool optimize = false;
+
+    // Split each animation frame into meshlets, drawn and culled one by one
+    bool meshlets = false;
+
+    // Simplified levels of detail appended after the full mesh
+    // Each level keeps lod_ratio of the triangles of the one before it
+    // Level n is drawn from lod_distance * 2^(n - 1) away (in model space)
+    size_t lod_count = 0;
+    float lod_ratio = 0.5f;
+    float lod_distance = 10.0f;
+
+    // Bake the loaded mesh into <path>.mesh, later loads map it instead of 
+    // parsing the json and gltf files (while none of them changed)
+    bool cache = true;
+};
+
+// Vertex cache efficiency of a mesh, ACMR is vertex shader runs per triangle
+struct MeshStats
+{
+    float acmr_before = 0.0f;
+    float acmr_after = 0.0f;
+};
+
 template <typename T> 
 class Mesh
 {
@@ -42,12 +91,38 @@ private:
     std::vector<T> vertices;
     std::vector<uint32_t> indices;
 
+    // Packed vertices, replace vertices when the mesh is quantized
+    std::vector<QuantizedVertex> quantized;
+
+    // Maps the quantized positions back into model space
+    glm::mat4 decode = glm::mat4(1.0f);
+
+    // Indices kept at 16 bits, replace indices when the mesh allows it
+    std::vector<uint16_t> short_indices;
+
+    // Widest index type found in the gltf files, only informational, the
+    // packed width follows the vertex count (see pack_indices)
+    uint32_t native_index_size = sizeof(uint16_t);
+
     // Texture path 
     std::optional<std::string> texture_path;
 
     // Animation data
     robin_hood::unordered_map<std::string, std::pair<size_t, size_t>> 
         animation_frames;
+
+    MeshStats stats;
+
+    // Clusters of the index buffer, empty unless requested
+    std::vector<Meshlet> meshlets;
+
+    // Levels of detail, the first is the full mesh (empty without any)
+    std::vector<MeshLod> lods;
+
+    // Baked file the mesh was loaded from, while it is open the vertices 
+    // and indices are read from the mapping instead of the arrays above
+    MappedFile cache;
+    MeshCacheData cached;
 public:
     Mesh() 
     {
@@ -55,13 +130,24 @@ public:
     }
     
     // Loads the model from a json file
-    void load_data(const std::string& path)
+    void load_data(const std::string& path, 
+        const MeshOptions& options = MeshOptions())
     {   
         vertices.clear();
         indices.clear();
-
-        std::fstream file(path);
-        nlohmann::json data = nlohmann::json::parse(file); 
+        quantized.clear();
+        short_indices.clear();
+        decode = glm::mat4(1.0f);
+        native_index_size = sizeof(uint16_t);
+        animation_frames.clear();
+        stats = MeshStats();
+        meshlets.clear();
+        lods.clear();
+        cache.close();
+        cached = MeshCacheData();
+
+        std::string manifest = read_file(path);
+        nlohmann::json data = nlohmann::json::parse(manifest); 
 
         if (!data.contains("texture")) 
             throw std::runtime_error("Invalid json file loaded");
@@ -71,10 +157,35 @@ public:
         if (!data.contains("animation_frames")) 
             throw std::runtime_error("Invalid json file loaded (no animation_frames)");
         nlohmann::json frame_paths = data["animation_frames"];
+
+        // The baked mesh is only used while it matches the sources and options
+        uint64_t cache_key = 0;
+        if (options.cache)
+        {
+            std::vector<std::string> sources;
+            for (auto& [key, value] : frame_paths.items()) 
+                sources.push_back(value);
+            cache_key = mesh_cache_key(manifest, path, sources, 
+                {(double) options.quantize, (double) options.optimize, 
+                (double) options.meshlets, (double) options.lod_count, 
+                options.lod_ratio, options.lod_distance, (double) sizeof(T)});
+            if (load_cache(path, cache_key)) return;
+        }
+
         for (auto& [key, value] : frame_paths.items())
         {
             load_animation(key, value);
         }
+        stats.acmr_before = stats.acmr_after = 
+            compute_acmr(indices.data(), indices.size(), vertices.size());
+
+        if (options.lod_count != 0) build_lods(options);
+        if (options.optimize) optimize();
+        if (options.meshlets) build_meshlets();
+        if (options.quantize) quantize();
+        pack_indices();
+
+        if (options.cache) save_cache(path, cache_key);
     }
 
     // Get the texture path to load into the batch manager
@@ -82,16 +193,200 @@ public:
 
     // Get the vertices and indices
     Buffer<uint8_t> get_vertices() { 
+        if (cache.is_open()) return Buffer<uint8_t>(
+            (uint8_t*) cached.vertices, 
+            cached.vertex_count * cached.vertex_stride);
+        if (!quantized.empty()) return Buffer<uint8_t>(
+            (uint8_t*) quantized.data(), 
+            quantized.size() * sizeof(QuantizedVertex));
         return Buffer<uint8_t>((uint8_t*) vertices.data(), 
-            vertices.size() * sizeof(Vertex)); }
+            vertices.size() * sizeof(T)); }
     Buffer<uint8_t> get_indices() { 
+        if (cache.is_open()) return Buffer<uint8_t>(
+            (uint8_t*) cached.indices, cached.index_count * cached.index_size);
+        if (!short_indices.empty()) return Buffer<uint8_t>(
+            (uint8_t*) short_indices.data(), 
+            short_indices.size() * sizeof(uint16_t));
         return Buffer<uint8_t>((uint8_t*) indices.data(), 
             indices.size() * sizeof(uint32_t)); }
+
+    // Bytes per index of get_indices
+    uint32_t get_index_size() 
+    { 
+        if (cache.is_open()) return cached.index_size;
+        return short_indices.empty() ? sizeof(uint32_t) : sizeof(uint16_t); 
+    }
+
+    size_t vertex_count() 
+    { 
+        if (cache.is_open()) return cached.vertex_count;
+        return quantized.empty() ? vertices.size() : quantized.size(); 
+    }
+
+    // Has to be applied on top of the model matrix
+    glm::mat4 get_decode_matrix() { return decode; }
+
+    // ACMR of the loaded indices, and after optimizing if it was requested
+    MeshStats get_stats() { return stats; }
+
+    // Index ranges are relative to the start of get_indices
+    const std::vector<Meshlet>& get_meshlets() { return meshlets; }
+
+    // Index ranges are relative to the start of get_indices
+    const std::vector<MeshLod>& get_lods() { return lods; }
+
+    // Indices of the full detail mesh, the levels of detail come after them
+    size_t index_count() 
+    { 
+        if (!lods.empty()) return lods[0].index_count;
+        if (cache.is_open()) return cached.index_count;
+        return short_indices.empty() ? indices.size() : short_indices.size(); 
+    }
 private:
+    // Maps the baked mesh, false if there is none for this key
+    bool load_cache(const std::string& path, uint64_t key)
+    {
+        if (!cache.open(mesh_cache_path(path), 
+            MappedFile::SEQUENTIAL | MappedFile::WILL_NEED)) return false;
+
+        size_t stride = sizeof(T);
+        if (!read_mesh_cache(cache, key, cached) 
+            || cached.vertex_stride != (cached.quantized ? 
+                sizeof(QuantizedVertex) : stride))
+        {
+            cache.close();
+            cached = MeshCacheData();
+            return false;
+        }
+
+        texture_path = cached.texture_path;
+        decode = cached.decode;
+        native_index_size = cached.native_index_size;
+        stats = {cached.acmr_before, cached.acmr_after};
+        for (auto& frame : cached.frames)
+            animation_frames[frame.name] = {frame.index_start, frame.index_count};
+        meshlets = std::move(cached.meshlets);
+        lods = std::move(cached.lods);
+        return true;
+    }
+
+    // Bakes the loaded mesh, failing to only costs the next load a parse
+    void save_cache(const std::string& path, uint64_t key)
+    {
+        MeshCacheData data;
+        Buffer<uint8_t> vertex_buffer = get_vertices();
+        Buffer<uint8_t> index_buffer = get_indices();
+        data.vertices = vertex_buffer.data();
+        data.vertex_count = vertex_count();
+        data.vertex_stride = quantized.empty() ? 
+            sizeof(T) : sizeof(QuantizedVertex);
+        data.indices = index_buffer.data();
+        data.index_size = get_index_size();
+        data.index_count = index_buffer.size() / data.index_size;
+        data.native_index_size = native_index_size;
+        data.quantized = !quantized.empty();
+        data.decode = decode;
+        data.acmr_before = stats.acmr_before;
+        data.acmr_after = stats.acmr_after;
+        data.texture_path = texture_path.value_or("");
+        for (auto& [name, frame] : animation_frames)
+            data.frames.push_back({name, frame.first, frame.second});
+        data.meshlets = meshlets;
+        data.lods = lods;
+        write_mesh_cache(mesh_cache_path(path), key, data);
+    }
+
     // Adds one animation frame to the model
     void load_animation(const std::string& identifier, const std::string& path);
+
+    // Reorders each animation frame for the vertex cache, then the vertices
+    // in the order they are first used. Frames own separate vertex ranges, 
+    // so the fetch order keeps them apart
+    void optimize()
+    {
+        for (auto& [key, frame] : animation_frames)
+        {
+            optimize_vertex_cache(indices.data() + frame.first, frame.second, 
+                vertices.size());
+        }
+        for (size_t level = 1; level < lods.size(); level++)
+        {
+            optimize_vertex_cache(indices.data() + lods[level].index_start, 
+                lods[level].index_count, vertices.size());
+        }
+
+        remap_vertices(vertices, 
+            optimize_vertex_fetch(indices.data(), indices.size(), vertices.size()));
+
+        stats.acmr_after = 
+            compute_acmr(indices.data(), index_count(), vertices.size());
+    }
+
+    // Simplifies every animation frame for each level, the frames of a level
+    // are stored together. Stops early once a level can't be reduced
+    void build_lods(const MeshOptions& options)
+    {
+        lods.push_back({0, indices.size(), 0.0f});
+        float ratio = 1.0f;
+        for (size_t level = 1; level <= options.lod_count; level++)
+        {
+            ratio *= options.lod_ratio;
+            std::vector<uint32_t> simplified;
+            for (auto& [key, frame] : animation_frames)
+            {
+                std::vector<uint32_t> result = simplify(
+                    indices.data() + frame.first, frame.second, 
+                    (const uint8_t*) vertices.data(), sizeof(T), vertices.size(), 
+                    (size_t) (frame.second / 3 * ratio) * 3);
+                simplified.insert(simplified.end(), result.begin(), result.end());
+            }
+            if (simplified.empty() || simplified.size() >= lods.back().index_count) 
+                break;
+
+            lods.push_back({indices.size(), simplified.size(), 
+                options.lod_distance * float(1 << (level - 1))});
+            indices.insert(indices.end(), simplified.begin(), simplified.end());
+        }
+        if (lods.size() == 1) lods.clear();
+    }
+
+    // Meshlets don't cross animation frames, so a frame is a range of them
+    // The position has to be the first member of T
+    void build_meshlets()
+    {
+        for (auto& [key, frame] : animation_frames)
+        {
+            std::vector<Meshlet> built = ::build_meshlets(
+                indices.data() + frame.first, frame.second, 
+                (const uint8_t*) vertices.data(), sizeof(T), vertices.size());
+            for (auto& meshlet : built) meshlet.index_start += frame.first;
+            meshlets.insert(meshlets.end(), built.begin(), built.end());
+        }
+    }
+
+    // Packs the vertices into quantized
+    void quantize() 
+    { 
+        throw std::runtime_error("Only textured meshes can be quantized"); 
+    }
+
+    // Keeps the indices at 16 bits whenever they can address every vertex
+    // of the mesh, whatever width the gltf files stored them in
+    void pack_indices()
+    {
+        if (indices.empty() || vertex_count() > 65536) return;
+
+        short_indices.resize(indices.size());
+        for (size_t i = 0; i < indices.size(); i++) 
+            short_indices[i] = (uint16_t) indices[i];
+        indices.clear();
+        indices.shrink_to_fit();
+    }
 };
 
+template <>
+void Mesh<Vertex>::quantize();
+
 class Model
 {
 public:
@@ -106,6 +401,23 @@ public:
     // Animation, done by changing the index buffer
     virtual size_t animation_start() = 0;
     virtual size_t animation_length() = 0;
+
+    // Bytes per index of the index buffer
+    virtual uint32_t index_size() = 0;
+
+    // Clusters drawn and culled separately, empty draws the model as one
+    virtual const std::vector<Meshlet>& get_meshlets() 
+    { 
+        static const std::vector<Meshlet> none;
+        return none; 
+    }
+
+    // Levels of detail picked by the compute shader, empty for none
+    virtual const std::vector<MeshLod>& get_lods() 
+    { 
+        static const std::vector<MeshLod> none;
+        return none; 
+    }
 };
 
 // One model to be rendered (has one texture and one set of buffers)
@@ -122,11 +434,23 @@ private:
     glm::mat4 modelmat = glm::mat4(1.0f);
 
     std::vector<uint8_t> model_buffer;
+
+    // Background load of the mesh, if any
+    LoadHandle loading;
 public:
     StandardModel();
     ~StandardModel();
 
-    virtual void load_mesh(const std::string& path);
+    virtual void load_mesh(const std::string& path, 
+        const MeshOptions& options = MeshOptions());
+
+    // Parses the mesh on the job system and returns right away, the model 
+    // can't be used until the handle is loaded. With a batch manager the 
+    // model is uploaded at the start of its next draw, after loading the 
+    // texture into the atlas (if given)
+    LoadHandle load_mesh_async(const std::string& path, 
+        const MeshOptions& options = MeshOptions(), 
+        BatchManager* batchmanager = nullptr, TextureAtlas* atlas = nullptr);
     virtual void load_texture(TextureAtlas* atlas);
 
     virtual void set_modelmat(const glm::mat4& mat);
@@ -138,7 +462,13 @@ public:
     virtual Buffer<uint8_t> get_index_buffer() { return mesh.get_indices(); }
 
     virtual size_t animation_start() { return 0; }
-    virtual size_t animation_length() { return mesh.get_indices().size() / sizeof(uint32_t); }
+    virtual size_t animation_length() { return mesh.index_count(); }
+    virtual uint32_t index_size() { return mesh.get_index_size(); }
+    virtual const std::vector<Meshlet>& get_meshlets() 
+    { 
+        return mesh.get_meshlets(); 
+    }
+    virtual const std::vector<MeshLod>& get_lods() { return mesh.get_lods(); }
 
     Batch* get_batch() { return batch; }
     size_t get_index() { return index; }
@@ -154,20 +484,42 @@ protected:
     size_t instance_index = SIZE_MAX;
 
     Mesh<T> mesh;
+
+    // Background load of the mesh, if any
+    LoadHandle loading;
  public:  
     BaseInstance() = default;
     ~BaseInstance() 
     {
+        loading.cancel();
         if (batch) batch->remove_instance_data(instance_index);
     }
     
-    void load_mesh(const std::string& path) { mesh.load_data(path); }
+    void load_mesh(const std::string& path, 
+        const MeshOptions& options = MeshOptions()) 
+    { 
+        mesh.load_data(path, options); 
+    }
+
+    // Parses the mesh on the job system, with a batch manager the instance 
+    // data is uploaded at the start of its next draw. Models can be made 
+    // out of it once the handle is uploaded
+    LoadHandle load_mesh_async(const std::string& path, 
+        const MeshOptions& options = MeshOptions(), 
+        BatchManager* batchmanager = nullptr)
+    {
+        loading.cancel();
+        loading = LoadHandle::start(
+            [this, path, options]() { mesh.load_data(path, options); }, 
+            batchmanager, [this, batchmanager]() { upload(batchmanager); });
+        return loading;
+    }
 
     void upload(BatchManager* batchmanager) 
     {
         if (this->mesh.get_vertices().size() == 0) return;
         auto [batch, index] = batchmanager->add_instance_data(this->get_vertex_buffer(), 
-            this->get_index_buffer());
+            this->get_index_buffer(), mesh.get_index_size(), mesh.get_lods());
         this->batch = batch;
         this->instance_index = index;
     }
@@ -175,6 +527,11 @@ protected:
     Batch* get_batch() { return batch; }
     Buffer<uint8_t> get_vertex_buffer() { return mesh.get_vertices(); } 
     Buffer<uint8_t> get_index_buffer() { return mesh.get_indices(); } 
+    glm::mat4 get_decode_matrix() { return mesh.get_decode_matrix(); }
+    uint32_t get_index_size() { return mesh.get_index_size(); }
+    const std::vector<Meshlet>& get_meshlets() { return mesh.get_meshlets(); }
+    const std::vector<MeshLod>& get_lods() { return mesh.get_lods(); }
+    size_t index_count() { return mesh.index_count(); }
     size_t get_index() { return instance_index; }
 };
 
@@ -219,6 +576,11 @@ public:
 
     // Animation, done by changing the index buffer
     virtual size_t animation_start() { return 0; }
-    virtual size_t animation_length() { 
-        return get_index_buffer().size() / sizeof(uint32_t); }
+    virtual size_t animation_length() { return base->index_count(); }
+    virtual uint32_t index_size() { return base->get_index_size(); }
+    virtual const std::vector<Meshlet>& get_meshlets() 
+    { 
+        return base->get_meshlets(); 
+    }
+    virtual const std::vector<MeshLod>& get_lods() { return base->get_lods(); }
 };
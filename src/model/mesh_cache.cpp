@@ -0,0 +1,253 @@
+#include "mesh_cache.h"
+
+// internal
+#include "util/util.h"
+
+// external
+#include <robin-hood/robin-hood.h>
+
+// std
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <thread>
+
+// Bump when the layout of the file (or of a stored struct), or how a mesh
+// is built before it is stored, changes
+// 2: small meshes with 32 bit source indices are stored at 16 bits
+constexpr uint32_t MESH_CACHE_VERSION = 2;
+constexpr char MESH_CACHE_MAGIC[4] = {'M', 'E', 'S', 'H'};
+
+// Sections start on this alignment, so the arrays can be read in place
+constexpr size_t MESH_CACHE_ALIGNMENT = 16;
+
+struct MeshCacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+
+    uint64_t vertex_count;
+    uint32_t vertex_stride;
+    uint32_t index_size;
+    uint64_t index_count;
+    uint32_t native_index_size;
+    uint32_t quantized;
+
+    float decode[16];
+    float acmr_before;
+    float acmr_after;
+
+    // Sizes of the stored structs, a build where they differ can't read it
+    uint32_t meshlet_size;
+    uint32_t lod_size;
+
+    uint64_t frame_count;
+    uint64_t meshlet_count;
+    uint64_t lod_count;
+    uint64_t texture_length;
+
+    // Offsets of the sections from the start of the file
+    uint64_t vertices_offset;
+    uint64_t indices_offset;
+    uint64_t frames_offset;
+    uint64_t frames_size;
+    uint64_t meshlets_offset;
+    uint64_t lods_offset;
+    uint64_t texture_offset;
+};
+
+std::string mesh_cache_path(const std::string& path)
+{
+    return path + ".mesh";
+}
+
+uint64_t mesh_cache_key(const std::string& manifest, const std::string& path,
+    const std::vector<std::string>& sources,
+    std::initializer_list<double> settings)
+{
+    std::string input = manifest;
+    auto append = [&](const void* data, size_t size)
+    {
+        input.append((const char*) data, size);
+    };
+
+    int64_t modified = file_mtime(path);
+    append(&modified, sizeof(modified));
+    for (auto& source : sources)
+    {
+        modified = file_mtime(source);
+        input += source;
+        append(&modified, sizeof(modified));
+    }
+    for (double setting : settings) append(&setting, sizeof(setting));
+    append(&MESH_CACHE_VERSION, sizeof(MESH_CACHE_VERSION));
+
+    return robin_hood::hash_bytes(input.data(), input.size());
+}
+
+// If [offset, offset + size) lies inside a file of file_size bytes
+static bool in_file(uint64_t offset, uint64_t size, size_t file_size)
+{
+    return offset <= file_size && size <= file_size - offset;
+}
+
+bool read_mesh_cache(const MappedFile& file, uint64_t key,
+    MeshCacheData& data)
+{
+    if (!file.is_open() || file.size() < sizeof(MeshCacheHeader)) return false;
+
+    MeshCacheHeader header;
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != MESH_CACHE_VERSION || header.key != key
+        || header.meshlet_size != sizeof(Meshlet)
+        || header.lod_size != sizeof(MeshLod)
+        || (header.index_size != sizeof(uint16_t)
+            && header.index_size != sizeof(uint32_t)))
+        return false;
+
+    // Counts are checked before multiplying, a corrupt one can't overflow
+    size_t size = file.size();
+    if (header.vertex_stride == 0
+        || header.vertex_count > size / header.vertex_stride
+        || header.index_count > size / header.index_size
+        || header.meshlet_count > size / sizeof(Meshlet)
+        || header.lod_count > size / sizeof(MeshLod)
+        || !in_file(header.vertices_offset,
+            header.vertex_count * header.vertex_stride, size)
+        || !in_file(header.indices_offset,
+            header.index_count * header.index_size, size)
+        || !in_file(header.frames_offset, header.frames_size, size)
+        || !in_file(header.meshlets_offset,
+            header.meshlet_count * sizeof(Meshlet), size)
+        || !in_file(header.lods_offset, 
+            header.lod_count * sizeof(MeshLod), size)
+        || !in_file(header.texture_offset, header.texture_length, size))
+        return false;
+
+    // Frames are (index start, index count, name length, name) records
+    std::vector<MeshCacheFrame> frames;
+    const uint8_t* cursor = file.data() + header.frames_offset;
+    const uint8_t* frames_end = cursor + header.frames_size;
+    for (uint64_t i = 0; i < header.frame_count; i++)
+    {
+        uint64_t record[3];
+        if ((size_t) (frames_end - cursor) < sizeof(record)) return false;
+        memcpy(record, cursor, sizeof(record));
+        cursor += sizeof(record);
+        if ((uint64_t) (frames_end - cursor) < record[2]) return false;
+        frames.push_back({std::string((const char*) cursor, record[2]),
+            record[0], record[1]});
+        cursor += record[2];
+    }
+
+    data.vertices = file.data() + header.vertices_offset;
+    data.vertex_count = header.vertex_count;
+    data.vertex_stride = header.vertex_stride;
+    data.indices = file.data() + header.indices_offset;
+    data.index_count = header.index_count;
+    data.index_size = header.index_size;
+    data.native_index_size = header.native_index_size;
+    data.quantized = header.quantized != 0;
+    memcpy(&data.decode, header.decode, sizeof(header.decode));
+    data.acmr_before = header.acmr_before;
+    data.acmr_after = header.acmr_after;
+    data.texture_path = std::string(
+        (const char*) file.data() + header.texture_offset, header.texture_length);
+    data.frames = std::move(frames);
+    data.meshlets.resize(header.meshlet_count);
+    memcpy(data.meshlets.data(), file.data() + header.meshlets_offset,
+        header.meshlet_count * sizeof(Meshlet));
+    data.lods.resize(header.lod_count);
+    memcpy(data.lods.data(), file.data() + header.lods_offset,
+        header.lod_count * sizeof(MeshLod));
+    return true;
+}
+
+// Pads the file to the section alignment, then writes the section
+static uint64_t write_section(std::ofstream& file, const void* data,
+    size_t size)
+{
+    static const char zeros[MESH_CACHE_ALIGNMENT] = {};
+    uint64_t offset = (uint64_t) file.tellp();
+    size_t padding = (MESH_CACHE_ALIGNMENT - offset % MESH_CACHE_ALIGNMENT)
+        % MESH_CACHE_ALIGNMENT;
+    file.write(zeros, padding);
+    if (size != 0) file.write((const char*) data, size);
+    return offset + padding;
+}
+
+bool write_mesh_cache(const std::string& path, uint64_t key,
+    const MeshCacheData& data)
+{
+    MeshCacheHeader header = {};
+    memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = MESH_CACHE_VERSION;
+    header.key = key;
+    header.vertex_count = data.vertex_count;
+    header.vertex_stride = data.vertex_stride;
+    header.index_size = data.index_size;
+    header.index_count = data.index_count;
+    header.native_index_size = data.native_index_size;
+    header.quantized = data.quantized;
+    memcpy(header.decode, &data.decode, sizeof(header.decode));
+    header.acmr_before = data.acmr_before;
+    header.acmr_after = data.acmr_after;
+    header.meshlet_size = sizeof(Meshlet);
+    header.lod_size = sizeof(MeshLod);
+    header.frame_count = data.frames.size();
+    header.meshlet_count = data.meshlets.size();
+    header.lod_count = data.lods.size();
+    header.texture_length = data.texture_path.size();
+
+    std::string frames;
+    for (auto& frame : data.frames)
+    {
+        uint64_t record[3] = {frame.index_start, frame.index_count,
+            frame.name.size()};
+        frames.append((const char*) record, sizeof(record));
+        frames += frame.name;
+    }
+    header.frames_size = frames.size();
+
+    // Written next to the target then renamed over it, so a reader (or
+    // another thread baking the same mesh) never sees a partial file
+    std::string temporary = path + "." + std::to_string(
+        std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios_base::binary |
+            std::ios_base::trunc);
+        if (!file.is_open()) return false;
+
+        // The header is written again once the offsets are known
+        file.write((const char*) &header, sizeof(header));
+        header.vertices_offset = write_section(file, data.vertices,
+            data.vertex_count * data.vertex_stride);
+        header.indices_offset = write_section(file, data.indices,
+            data.index_count * data.index_size);
+        header.frames_offset = write_section(file, frames.data(), frames.size());
+        header.meshlets_offset = write_section(file, data.meshlets.data(),
+            data.meshlets.size() * sizeof(Meshlet));
+        header.lods_offset = write_section(file, data.lods.data(),
+            data.lods.size() * sizeof(MeshLod));
+        header.texture_offset = write_section(file, data.texture_path.data(),
+            data.texture_path.size());
+        file.seekp(0);
+        file.write((const char*) &header, sizeof(header));
+        if (!file.good())
+        {
+            std::error_code error;
+            file.close();
+            std::filesystem::remove(temporary, error);
+            return false;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (!error) return true;
+    std::filesystem::remove(temporary, error);
+    return false;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+// internal
+#include "model/lod.h"
+#include "model/meshlet.h"
+#include "util/mapped_file.h"
+
+// external
+#include <glm/glm.hpp>
+
+// std
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+// Baked meshes, written after a mesh is loaded from its json and gltf files
+// so later runs map the final vertex and index arrays instead of parsing
+// The file is only valid for the key it was written with, see mesh_cache_key
+
+// An animation frame, a range of the indices
+struct MeshCacheFrame
+{
+    std::string name;
+    size_t index_start;
+    size_t index_count;
+};
+
+// Everything a loaded mesh is made of
+// When read the vertices and indices point into the mapped file
+struct MeshCacheData
+{
+    const uint8_t* vertices = nullptr;
+    size_t vertex_count = 0;
+    uint32_t vertex_stride = 0;
+
+    const uint8_t* indices = nullptr;
+    size_t index_count = 0;
+    uint32_t index_size = 0;
+
+    uint32_t native_index_size = 0;
+    bool quantized = false;
+    glm::mat4 decode = glm::mat4(1.0f);
+    float acmr_before = 0.0f;
+    float acmr_after = 0.0f;
+
+    std::string texture_path;
+    std::vector<MeshCacheFrame> frames;
+    std::vector<Meshlet> meshlets;
+    std::vector<MeshLod> lods;
+};
+
+// Path of the baked file of a mesh json
+std::string mesh_cache_path(const std::string& path);
+
+// Identifies what a mesh was built from, the contents of the json, the
+// modification times of it and its source files, and the load settings
+uint64_t mesh_cache_key(const std::string& manifest, const std::string& path,
+    const std::vector<std::string>& sources,
+    std::initializer_list<double> settings);
+
+// Reads the mapped file, false if it isn't a cache or was written for
+// another key. The arrays of data stay valid as long as the file is mapped
+bool read_mesh_cache(const MappedFile& file, uint64_t key,
+    MeshCacheData& data);
+
+// Writes the file (replacing it at once), false if it couldn't be written
+bool write_mesh_cache(const std::string& path, uint64_t key,
+    const MeshCacheData& data);
@@ -0,0 +1,196 @@
+#include "mesh_optimizer.h"
+
+// std
+#include <algorithm>
+#include <cmath>
+
+// Scoring constants from Forsyth's paper
+constexpr float CACHE_DECAY_POWER = 1.5f;
+constexpr float LAST_TRI_SCORE = 0.75f;
+constexpr float VALENCE_BOOST_SCALE = 2.0f;
+constexpr float VALENCE_BOOST_POWER = 0.5f;
+
+// The cache used while optimizing is a bit bigger than the simulated one,
+// vertices that fall out of it still get a score on the next pass
+constexpr size_t OPTIMIZE_CACHE_SIZE = VERTEX_CACHE_SIZE + 3;
+
+float compute_acmr(const uint32_t* indices, size_t index_count,
+    size_t vertex_count, size_t cache_size)
+{
+    if (index_count < 3) return 0.0f;
+
+    // A vertex is in the cache if it was added less than cache_size misses ago
+    std::vector<size_t> timestamps(vertex_count, 0);
+    size_t time = cache_size + 1;
+    size_t misses = 0;
+
+    for (size_t i = 0; i < index_count; i++)
+    {
+        uint32_t vertex = indices[i];
+        if (time - timestamps[vertex] > cache_size)
+        {
+            timestamps[vertex] = time++;
+            misses++;
+        }
+    }
+
+    return (float) misses / (index_count / 3);
+}
+
+static float vertex_score(int32_t cache_position, uint32_t remaining)
+{
+    if (remaining == 0) return -1.0f;
+
+    float score = 0.0f;
+    if (cache_position >= 0)
+    {
+        if (cache_position < 3) score = LAST_TRI_SCORE;
+        else
+        {
+            float scaler = 1.0f / (OPTIMIZE_CACHE_SIZE - 3);
+            score = std::pow(1.0f - (cache_position - 3) * scaler,
+                CACHE_DECAY_POWER);
+        }
+    }
+
+    return score + VALENCE_BOOST_SCALE *
+        std::pow((float) remaining, -VALENCE_BOOST_POWER);
+}
+
+void optimize_vertex_cache(uint32_t* indices, size_t index_count,
+    size_t vertex_count)
+{
+    size_t triangle_count = index_count / 3;
+    if (triangle_count < 2) return;
+
+    // Triangles that use each vertex, packed (adjacency_start is a prefix sum)
+    std::vector<uint32_t> remaining(vertex_count, 0);
+    for (size_t i = 0; i < triangle_count * 3; i++) remaining[indices[i]]++;
+
+    std::vector<uint32_t> adjacency_start(vertex_count + 1, 0);
+    for (size_t i = 0; i < vertex_count; i++)
+        adjacency_start[i + 1] = adjacency_start[i] + remaining[i];
+
+    std::vector<uint32_t> adjacency(triangle_count * 3);
+    std::vector<uint32_t> fill(adjacency_start.begin(), adjacency_start.end() - 1);
+    for (size_t i = 0; i < triangle_count * 3; i++)
+        adjacency[fill[indices[i]]++] = i / 3;
+
+    std::vector<int32_t> cache_position(vertex_count, -1);
+    std::vector<float> scores(vertex_count);
+    for (size_t i = 0; i < vertex_count; i++)
+        scores[i] = vertex_score(-1, remaining[i]);
+
+    std::vector<float> triangle_scores(triangle_count);
+    for (size_t i = 0; i < triangle_count; i++)
+    {
+        triangle_scores[i] = scores[indices[i * 3]] +
+            scores[indices[i * 3 + 1]] + scores[indices[i * 3 + 2]];
+    }
+
+    std::vector<bool> emitted(triangle_count, false);
+    std::vector<uint32_t> result(triangle_count * 3);
+
+    // LRU cache, a triangle pushes its three vertices to the front
+    uint32_t cache[OPTIMIZE_CACHE_SIZE + 3];
+    size_t cache_count = 0;
+
+    size_t best = 0;
+    for (size_t i = 1; i < triangle_count; i++)
+        if (triangle_scores[i] > triangle_scores[best]) best = i;
+
+    // Fallback cursor for when nothing in the cache has triangles left
+    size_t cursor = 0;
+
+    for (size_t output = 0; output < triangle_count; output++)
+    {
+        if (best == SIZE_MAX)
+        {
+            while (emitted[cursor]) cursor++;
+            best = cursor;
+        }
+
+        const uint32_t* triangle = indices + best * 3;
+        std::copy(triangle, triangle + 3, result.begin() + output * 3);
+        emitted[best] = true;
+
+        // Remove the triangle from the adjacency of its vertices
+        for (size_t k = 0; k < 3; k++)
+        {
+            uint32_t vertex = triangle[k];
+            uint32_t* begin = adjacency.data() + adjacency_start[vertex];
+            uint32_t* end = begin + remaining[vertex];
+            std::iter_swap(std::find(begin, end, (uint32_t) best), end - 1);
+            remaining[vertex]--;
+        }
+
+        // Build the new cache, the triangle's vertices go first
+        uint32_t new_cache[OPTIMIZE_CACHE_SIZE + 3];
+        size_t new_count = 0;
+        for (size_t k = 0; k < 3; k++) new_cache[new_count++] = triangle[k];
+        for (size_t k = 0; k < cache_count; k++)
+        {
+            uint32_t vertex = cache[k];
+            if (vertex != triangle[0] && vertex != triangle[1] &&
+                vertex != triangle[2]) new_cache[new_count++] = vertex;
+        }
+
+        // Vertices past the end of the cache are evicted
+        for (size_t k = OPTIMIZE_CACHE_SIZE; k < new_count; k++)
+        {
+            cache_position[new_cache[k]] = -1;
+            scores[new_cache[k]] = vertex_score(-1, remaining[new_cache[k]]);
+        }
+
+        cache_count = std::min(new_count, OPTIMIZE_CACHE_SIZE);
+        std::copy(new_cache, new_cache + cache_count, cache);
+
+        // Rescore the cached vertices and the triangles they touch,
+        // picking the next triangle from those
+        for (size_t k = 0; k < cache_count; k++)
+        {
+            cache_position[cache[k]] = k;
+            scores[cache[k]] = vertex_score(k, remaining[cache[k]]);
+        }
+
+        best = SIZE_MAX;
+        float best_score = -1.0f;
+        for (size_t k = 0; k < cache_count; k++)
+        {
+            uint32_t vertex = cache[k];
+            for (size_t t = 0; t < remaining[vertex]; t++)
+            {
+                uint32_t tri = adjacency[adjacency_start[vertex] + t];
+                float score = scores[indices[tri * 3]] +
+                    scores[indices[tri * 3 + 1]] + scores[indices[tri * 3 + 2]];
+                triangle_scores[tri] = score;
+                if (score > best_score)
+                {
+                    best_score = score;
+                    best = tri;
+                }
+            }
+        }
+    }
+
+    std::copy(result.begin(), result.end(), indices);
+}
+
+std::vector<uint32_t> optimize_vertex_fetch(uint32_t* indices,
+    size_t index_count, size_t vertex_count)
+{
+    std::vector<uint32_t> remap(vertex_count, UINT32_MAX);
+    uint32_t next = 0;
+
+    for (size_t i = 0; i < index_count; i++)
+    {
+        uint32_t& vertex = remap[indices[i]];
+        if (vertex == UINT32_MAX) vertex = next++;
+        indices[i] = vertex;
+    }
+
+    for (size_t i = 0; i < vertex_count; i++)
+        if (remap[i] == UINT32_MAX) remap[i] = next++;
+
+    return remap;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+// std
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Size of the simulated post transform cache, used when measuring ACMR
+constexpr size_t VERTEX_CACHE_SIZE = 16;
+
+// Average number of vertex shader invocations per triangle, simulated with a
+// FIFO cache (1.0 is a perfect strip like order, 3.0 is no reuse at all)
+float compute_acmr(const uint32_t* indices, size_t index_count,
+    size_t vertex_count, size_t cache_size = VERTEX_CACHE_SIZE);
+
+// Reorders the triangles of indices for post transform cache hits
+// (Forsyth's linear speed vertex cache optimisation), in place
+void optimize_vertex_cache(uint32_t* indices, size_t index_count,
+    size_t vertex_count);
+
+// Renumbers the vertices in the order the indices first use them, so the
+// vertex fetch walks the buffer forward. Rewrites indices and returns the
+// remap (old vertex -> new vertex), unused vertices are moved to the end
+std::vector<uint32_t> optimize_vertex_fetch(uint32_t* indices,
+    size_t index_count, size_t vertex_count);
+
+// Moves the vertices to where the remap of optimize_vertex_fetch puts them
+template <typename T>
+void remap_vertices(std::vector<T>& vertices, const std::vector<uint32_t>& remap)
+{
+    std::vector<T> result(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++) result[remap[i]] = vertices[i];
+    vertices.swap(result);
+}
@@ -0,0 +1,114 @@
+#include "meshlet.h"
+
+// std
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+static glm::vec3 read_position(const uint8_t* positions, size_t stride,
+    uint32_t index)
+{
+    glm::vec3 position;
+    memcpy(&position, positions + index * stride, sizeof(glm::vec3));
+    return position;
+}
+
+// Fills in the bounding sphere and normal cone of the meshlet
+static void compute_bounds(Meshlet& meshlet, const uint32_t* indices,
+    const uint8_t* positions, size_t stride)
+{
+    glm::vec3 min(FLT_MAX);
+    glm::vec3 max(-FLT_MAX);
+    for (size_t i = 0; i < meshlet.index_count; i++)
+    {
+        glm::vec3 position = read_position(positions, stride,
+            indices[meshlet.index_start + i]);
+        min = glm::min(min, position);
+        max = glm::max(max, position);
+    }
+
+    meshlet.center = (min + max) * 0.5f;
+    meshlet.radius = 0.0f;
+    for (size_t i = 0; i < meshlet.index_count; i++)
+    {
+        glm::vec3 position = read_position(positions, stride,
+            indices[meshlet.index_start + i]);
+        meshlet.radius = std::max(meshlet.radius,
+            glm::length(position - meshlet.center));
+    }
+
+    // The cone axis is the average facing, its spread the widest normal
+    std::vector<glm::vec3> normals;
+    glm::vec3 axis(0.0f);
+    for (size_t i = 0; i < meshlet.index_count; i += 3)
+    {
+        const uint32_t* triangle = indices + meshlet.index_start + i;
+        glm::vec3 a = read_position(positions, stride, triangle[0]);
+        glm::vec3 b = read_position(positions, stride, triangle[1]);
+        glm::vec3 c = read_position(positions, stride, triangle[2]);
+        glm::vec3 normal = glm::cross(b - a, c - a);
+        float length = glm::length(normal);
+        if (length == 0.0f) continue;
+
+        normals.push_back(normal / length);
+        axis += normals.back();
+    }
+
+    meshlet.cone_axis = glm::vec3(0.0f, 0.0f, 1.0f);
+    meshlet.cone_cutoff = 1.0f;
+    if (normals.empty() || glm::length(axis) == 0.0f) return;
+    axis = glm::normalize(axis);
+
+    float min_dot = 1.0f;
+    for (const glm::vec3& normal : normals)
+        min_dot = std::min(min_dot, glm::dot(axis, normal));
+
+    // A cone wider than a hemisphere can always be seen from somewhere
+    meshlet.cone_axis = axis;
+    if (min_dot <= 0.0f) return;
+    meshlet.cone_cutoff = std::sqrt(1.0f - min_dot * min_dot);
+}
+
+std::vector<Meshlet> build_meshlets(const uint32_t* indices, size_t index_count,
+    const uint8_t* positions, size_t stride, size_t vertex_count)
+{
+    std::vector<Meshlet> meshlets;
+    if (index_count < 3) return meshlets;
+
+    // Which meshlet last used each vertex, so unique vertices can be counted
+    std::vector<size_t> owner(vertex_count, SIZE_MAX);
+    Meshlet current;
+    size_t unique = 0;
+
+    for (size_t i = 0; i + 2 < index_count; i += 3)
+    {
+        size_t added = 0;
+        for (size_t k = 0; k < 3; k++)
+        {
+            if (owner[indices[i + k]] != meshlets.size()) added++;
+        }
+
+        if (unique + added > MESHLET_MAX_VERTICES ||
+            current.index_count / 3 == MESHLET_MAX_TRIANGLES)
+        {
+            compute_bounds(current, indices, positions, stride);
+            meshlets.push_back(current);
+            current = Meshlet();
+            current.index_start = i;
+            unique = 0;
+        }
+
+        for (size_t k = 0; k < 3; k++)
+        {
+            if (owner[indices[i + k]] == meshlets.size()) continue;
+            owner[indices[i + k]] = meshlets.size();
+            unique++;
+        }
+        current.index_count += 3;
+    }
+
+    compute_bounds(current, indices, positions, stride);
+    meshlets.push_back(current);
+    return meshlets;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+// external
+#include <glm/glm.hpp>
+
+// std
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Limits of one meshlet, small enough to be culled on its own
+constexpr size_t MESHLET_MAX_VERTICES = 64;
+constexpr size_t MESHLET_MAX_TRIANGLES = 124;
+
+// A cluster of triangles, a contiguous range of the mesh's index buffer
+struct Meshlet
+{
+    size_t index_start = 0;
+    size_t index_count = 0;
+
+    // Bounding sphere, in the space of the vertex positions
+    glm::vec3 center = glm::vec3(0.0f);
+    float radius = 0.0f;
+
+    // Normal cone, the cluster faces away from a camera at p when
+    //     dot(center - p, cone_axis) >= cone_cutoff * length(center - p) + radius
+    // A cutoff of 1 means the normals spread too far to ever be culled
+    glm::vec3 cone_axis = glm::vec3(0.0f, 0.0f, 1.0f);
+    float cone_cutoff = 1.0f;
+};
+
+// Splits the triangles of indices into meshlets, in order, so their index
+// ranges stay contiguous (run the vertex cache optimizer first for tight
+// clusters). Positions are read as 3 floats every stride bytes
+std::vector<Meshlet> build_meshlets(const uint32_t* indices, size_t index_count,
+    const uint8_t* positions, size_t stride, size_t vertex_count);
@@ -0,0 +1,57 @@
+#pragma once
+
+// external
+#include <glm/glm.hpp>
+
+// std
+#include <cmath>
+#include <cstdint>
+
+// Helpers for packing vertex attributes into smaller formats
+// The shaders decode the same way, snorm16 attributes are normalized by 
+// bgfx so only the octahedral normals need decoding by hand:
+//     vec3 n = vec3(e.xy, 1.0 - abs(e.x) - abs(e.y));
+//     if (n.z < 0.0) n.xy = (1.0 - abs(n.yx)) * sign(n.xy);
+//     n = normalize(n);
+
+inline int16_t pack_snorm16(float value)
+{
+    // Converting nan to an integer is undefined
+    if (std::isnan(value)) return 0;
+    value = glm::clamp(value, -1.0f, 1.0f);
+    return (int16_t) std::round(value * 32767.0f);
+}
+
+inline float unpack_snorm16(int16_t value)
+{
+    return glm::max(value / 32767.0f, -1.0f);
+}
+
+// Maps a unit vector onto the [-1, 1] square of an octahedron
+// Zero (or broken) normals, which gltf files do have, become (0, 0, 1)
+inline glm::vec2 oct_encode(glm::vec3 n)
+{
+    float sum = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    if (!(sum > 0.0f) || !std::isfinite(sum)) return glm::vec2(0.0f, 0.0f);
+    n = n / sum;
+    glm::vec2 p(n.x, n.y);
+    if (n.z < 0.0f)
+    {
+        p = glm::vec2(
+            (1.0f - std::abs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f), 
+            (1.0f - std::abs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f));
+    }
+    return p;
+}
+
+inline glm::vec3 oct_decode(glm::vec2 e)
+{
+    glm::vec3 n(e.x, e.y, 1.0f - std::abs(e.x) - std::abs(e.y));
+    if (n.z < 0.0f)
+    {
+        float x = n.x;
+        n.x = (1.0f - std::abs(n.y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        n.y = (1.0f - std::abs(x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+    }
+    return glm::normalize(n);
+}
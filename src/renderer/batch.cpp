@@ -6,6 +6,7 @@
 #include "util/util.h"
 #include "global.h"
 #include "core/shader.h"
+#include "util/timer.h"
 
 // std
 #include <cstdint>
@@ -16,40 +17,72 @@
 #include <string>
 #include <iostream>
 #include <algorithm>
+#include <cfloat>
+#include <cstring>
 
 Batch::Batch()
 {
     vbh = BGFX_INVALID_HANDLE;
     ibh = BGFX_INVALID_HANDLE;
     objs_buffer = BGFX_INVALID_HANDLE;
+    bounds_buffer = BGFX_INVALID_HANDLE;
+    lods_buffer = BGFX_INVALID_HANDLE;
     instances_buffer = BGFX_INVALID_HANDLE;
     indirect_buffer = BGFX_INVALID_HANDLE;
     compute_program = BGFX_INVALID_HANDLE;
+    draw_params = BGFX_INVALID_HANDLE;
+    cull_params = BGFX_INVALID_HANDLE;
+    lod_params = BGFX_INVALID_HANDLE;
+    frustum_planes = BGFX_INVALID_HANDLE;
+    occlusion_params = BGFX_INVALID_HANDLE;
+    occlusion_view_proj = BGFX_INVALID_HANDLE;
+    hiz_sampler = BGFX_INVALID_HANDLE;
     size = 0;
 }
 
 Batch::Batch(size_t size, const std::string& compute_path, 
     const bgfx::VertexLayout& vertex_layout, 
-    const bgfx::VertexLayout& model_layout)
+    const bgfx::VertexLayout& model_layout, size_t max_size, 
+    uint32_t index_size)
 {
     compute_program = BGFX_INVALID_HANDLE;
     this->size = size;
+    this->max_size = std::max(size, max_size);
+    this->index_size = index_size == sizeof(uint16_t) ? 
+        sizeof(uint16_t) : sizeof(uint32_t);
     this->vertex_layout = vertex_layout;
     this->model_layout = model_layout;
     vbh = bgfx::createDynamicVertexBuffer(size, vertex_layout, 
         BGFX_BUFFER_ALLOW_RESIZE);
-    ibh = bgfx::createDynamicIndexBuffer(size, 
-        BGFX_BUFFER_ALLOW_RESIZE | BGFX_BUFFER_INDEX32);
+    ibh = bgfx::createDynamicIndexBuffer(size, BGFX_BUFFER_ALLOW_RESIZE | 
+        (this->index_size == sizeof(uint32_t) ? BGFX_BUFFER_INDEX32 : 0));
     objs_buffer = bgfx::createDynamicVertexBuffer((uint32_t) 0, 
         ObjIndex::layout(), 
         BGFX_BUFFER_ALLOW_RESIZE | BGFX_BUFFER_COMPUTE_READ);
+    bounds_buffer = bgfx::createDynamicVertexBuffer((uint32_t) 0, 
+        ClusterBounds::layout(), 
+        BGFX_BUFFER_ALLOW_RESIZE | BGFX_BUFFER_COMPUTE_READ);
+    lods_buffer = bgfx::createDynamicVertexBuffer((uint32_t) 0, 
+        LodIndex::layout(), 
+        BGFX_BUFFER_ALLOW_RESIZE | BGFX_BUFFER_COMPUTE_READ);
     instances_buffer = bgfx::createDynamicVertexBuffer((uint32_t) 0, 
-        model_layout, BGFX_BUFFER_ALLOW_RESIZE);
+        model_layout, BGFX_BUFFER_ALLOW_RESIZE | BGFX_BUFFER_COMPUTE_READ);
     draw_params = bgfx::createUniform("draw_params", bgfx::UniformType::Vec4);
+    cull_params = bgfx::createUniform("cull_params", bgfx::UniformType::Vec4);
+    lod_params = bgfx::createUniform("lod_params", bgfx::UniformType::Vec4);
+    frustum_planes = 
+        bgfx::createUniform("frustum_planes", bgfx::UniformType::Vec4, 6);
+    occlusion_params = 
+        bgfx::createUniform("occlusion_params", bgfx::UniformType::Vec4);
+    occlusion_view_proj = 
+        bgfx::createUniform("occlusion_view_proj", bgfx::UniformType::Mat4);
+    hiz_sampler = bgfx::createUniform("s_hiz", bgfx::UniformType::Sampler);
+    vertex_allocator = RangeAllocator(size);
+    index_allocator = RangeAllocator(size);
+    vertex_data.resize(size * vertex_layout.getStride());
+    index_data.resize(size * this->index_size);
     set_compute_program(compute_path);
     indirect_buffer = BGFX_INVALID_HANDLE;
-    start_update = end_update = SIZE_MAX;
-    refresh = false;
 }
 
 Batch::Batch(Batch&& other) noexcept
@@ -59,29 +92,68 @@ Batch::Batch(Batch&& other) noexcept
     this->vbh = other.vbh;
     this->ibh = other.ibh;
     this->objs_buffer = other.objs_buffer;
+    this->bounds_buffer = other.bounds_buffer;
+    this->lods_buffer = other.lods_buffer;
     this->instances_buffer = other.instances_buffer;
     this->indirect_buffer = other.indirect_buffer;
     this->compute_program = other.compute_program;
     this->draw_params = other.draw_params;
+    this->cull_params = other.cull_params;
+    this->lod_params = other.lod_params;
+    this->frustum_planes = other.frustum_planes;
+    this->hiz = other.hiz;
+    this->bvh = other.bvh;
+    this->occlusion_params = other.occlusion_params;
+    this->occlusion_view_proj = other.occlusion_view_proj;
+    this->hiz_sampler = other.hiz_sampler;
+    this->frustum = other.frustum;
+    this->cpu_culling = other.cpu_culling;
+    this->cpu_frustum = other.cpu_frustum;
+    this->spheres = std::move(other.spheres);
+    this->visibility = std::move(other.visibility);
     this->size = other.size;
+    this->max_size = other.max_size;
+    this->index_size = other.index_size;
     this->model_data = std::move(other.model_data);
     this->objs_data = std::move(other.objs_data);
-    this->vertex_buffer_usage = std::move(other.vertex_buffer_usage);
-    this->index_buffer_usage = std::move(other.index_buffer_usage);
-    this->start_update = other.start_update;
-    this->end_update = other.end_update;
-    this->refresh = other.refresh;
-    this->current_index = other.current_index;
-    this->draw_indexes = std::move(other.draw_indexes);
-    this->instance_indexes = std::move(other.instance_indexes);
-    this->draw_to_instance = std::move(other.draw_to_instance);
+    this->bounds_data = std::move(other.bounds_data);
+    this->lods_data = std::move(other.lods_data);
+    this->lod_allocator = std::move(other.lod_allocator);
+    this->lods_dirty = other.lods_dirty;
+    this->vertex_allocator = std::move(other.vertex_allocator);
+    this->index_allocator = std::move(other.index_allocator);
+    this->vertex_data = std::move(other.vertex_data);
+    this->index_data = std::move(other.index_data);
+    this->defragment_budget = other.defragment_budget;
+    this->dirty_models = std::move(other.dirty_models);
+    this->dirty_objs = std::move(other.dirty_objs);
+    this->upload_gap = other.upload_gap;
+    this->dispatch_gap = other.dispatch_gap;
+    this->gpu_capacity = other.gpu_capacity;
+    this->indirect_capacity = other.indirect_capacity;
+    this->stats = other.stats;
+    this->instances = std::move(other.instances);
+    this->draws = std::move(other.draws);
+    this->draw_handles = std::move(other.draw_handles);
+    memcpy(this->camera, other.camera, sizeof(camera));
+    memcpy(this->lod_settings, other.lod_settings, sizeof(lod_settings));
+    this->camera_moved = other.camera_moved;
+    this->camera_draws = other.camera_draws;
     other.vbh = BGFX_INVALID_HANDLE;
     other.ibh = BGFX_INVALID_HANDLE;
     other.objs_buffer = BGFX_INVALID_HANDLE;
+    other.bounds_buffer = BGFX_INVALID_HANDLE;
+    other.lods_buffer = BGFX_INVALID_HANDLE;
     other.instances_buffer = BGFX_INVALID_HANDLE;
     other.indirect_buffer = BGFX_INVALID_HANDLE;
     other.compute_program = BGFX_INVALID_HANDLE;
     other.draw_params = BGFX_INVALID_HANDLE;
+    other.cull_params = BGFX_INVALID_HANDLE;
+    other.lod_params = BGFX_INVALID_HANDLE;
+    other.frustum_planes = BGFX_INVALID_HANDLE;
+    other.occlusion_params = BGFX_INVALID_HANDLE;
+    other.occlusion_view_proj = BGFX_INVALID_HANDLE;
+    other.hiz_sampler = BGFX_INVALID_HANDLE;
     other.size = 0;
 }
 
@@ -92,29 +164,68 @@ Batch& Batch::operator=(Batch&& other) noexcept
     this->vbh = other.vbh;
     this->ibh = other.ibh;
     this->objs_buffer = other.objs_buffer;
+    this->bounds_buffer = other.bounds_buffer;
+    this->lods_buffer = other.lods_buffer;
     this->instances_buffer = other.instances_buffer;
     this->indirect_buffer = other.indirect_buffer;
     this->compute_program = other.compute_program;
     this->draw_params = other.draw_params;
+    this->cull_params = other.cull_params;
+    this->lod_params = other.lod_params;
+    this->frustum_planes = other.frustum_planes;
+    this->hiz = other.hiz;
+    this->bvh = other.bvh;
+    this->occlusion_params = other.occlusion_params;
+    this->occlusion_view_proj = other.occlusion_view_proj;
+    this->hiz_sampler = other.hiz_sampler;
+    this->frustum = other.frustum;
+    this->cpu_culling = other.cpu_culling;
+    this->cpu_frustum = other.cpu_frustum;
+    this->spheres = std::move(other.spheres);
+    this->visibility = std::move(other.visibility);
     this->size = other.size;
+    this->max_size = other.max_size;
+    this->index_size = other.index_size;
     this->model_data = std::move(other.model_data);
     this->objs_data = std::move(other.objs_data);
-    this->vertex_buffer_usage = std::move(other.vertex_buffer_usage);
-    this->index_buffer_usage = std::move(other.index_buffer_usage);
-    this->start_update = other.start_update;
-    this->end_update = other.end_update;
-    this->refresh = other.refresh;
-    this->current_index = other.current_index;
-    this->draw_indexes = std::move(other.draw_indexes);
-    this->instance_indexes = std::move(other.instance_indexes);
-    this->draw_to_instance = std::move(other.draw_to_instance);
+    this->bounds_data = std::move(other.bounds_data);
+    this->lods_data = std::move(other.lods_data);
+    this->lod_allocator = std::move(other.lod_allocator);
+    this->lods_dirty = other.lods_dirty;
+    this->vertex_allocator = std::move(other.vertex_allocator);
+    this->index_allocator = std::move(other.index_allocator);
+    this->vertex_data = std::move(other.vertex_data);
+    this->index_data = std::move(other.index_data);
+    this->defragment_budget = other.defragment_budget;
+    this->dirty_models = std::move(other.dirty_models);
+    this->dirty_objs = std::move(other.dirty_objs);
+    this->upload_gap = other.upload_gap;
+    this->dispatch_gap = other.dispatch_gap;
+    this->gpu_capacity = other.gpu_capacity;
+    this->indirect_capacity = other.indirect_capacity;
+    this->stats = other.stats;
+    this->instances = std::move(other.instances);
+    this->draws = std::move(other.draws);
+    this->draw_handles = std::move(other.draw_handles);
+    memcpy(this->camera, other.camera, sizeof(camera));
+    memcpy(this->lod_settings, other.lod_settings, sizeof(lod_settings));
+    this->camera_moved = other.camera_moved;
+    this->camera_draws = other.camera_draws;
     other.vbh = BGFX_INVALID_HANDLE;
     other.ibh = BGFX_INVALID_HANDLE;
     other.objs_buffer = BGFX_INVALID_HANDLE;
+    other.bounds_buffer = BGFX_INVALID_HANDLE;
+    other.lods_buffer = BGFX_INVALID_HANDLE;
     other.instances_buffer = BGFX_INVALID_HANDLE;
     other.indirect_buffer = BGFX_INVALID_HANDLE;
     other.compute_program = BGFX_INVALID_HANDLE;
     other.draw_params = BGFX_INVALID_HANDLE;
+    other.cull_params = BGFX_INVALID_HANDLE;
+    other.lod_params = BGFX_INVALID_HANDLE;
+    other.frustum_planes = BGFX_INVALID_HANDLE;
+    other.occlusion_params = BGFX_INVALID_HANDLE;
+    other.occlusion_view_proj = BGFX_INVALID_HANDLE;
+    other.hiz_sampler = BGFX_INVALID_HANDLE;
     other.size = 0;
     return *this;
 }
@@ -124,49 +235,83 @@ Batch::~Batch()
     if (bgfx::isValid(vbh)) bgfx::destroy(vbh);
     if (bgfx::isValid(ibh)) bgfx::destroy(ibh);
     if (bgfx::isValid(objs_buffer)) bgfx::destroy(objs_buffer);
+    if (bgfx::isValid(bounds_buffer)) bgfx::destroy(bounds_buffer);
+    if (bgfx::isValid(lods_buffer)) bgfx::destroy(lods_buffer);
     if (bgfx::isValid(instances_buffer)) bgfx::destroy(instances_buffer);
     if (bgfx::isValid(indirect_buffer)) bgfx::destroy(indirect_buffer);
     if (bgfx::isValid(compute_program)) bgfx::destroy(compute_program);
     if (bgfx::isValid(draw_params)) bgfx::destroy(draw_params);
+    if (bgfx::isValid(cull_params)) bgfx::destroy(cull_params);
+    if (bgfx::isValid(lod_params)) bgfx::destroy(lod_params);
+    if (bgfx::isValid(frustum_planes)) bgfx::destroy(frustum_planes);
+    if (bgfx::isValid(occlusion_params)) bgfx::destroy(occlusion_params);
+    if (bgfx::isValid(occlusion_view_proj)) bgfx::destroy(occlusion_view_proj);
+    if (bgfx::isValid(hiz_sampler)) bgfx::destroy(hiz_sampler);
 }
 
 size_t Batch::add(Model* model)
 {
-    size_t instance_index = add_instance_data(
-        model->get_vertex_buffer(), model->get_index_buffer());
-    add_instance(model, instance_index, false);
-    return instance_index;
+    size_t instance_index = add_instance_data(model->get_vertex_buffer(), 
+        model->get_index_buffer(), model->get_lods());
+    return add_clusters(model, instance_index, model->get_meshlets());
 }
 
 void Batch::edit_model_data(Model* model, size_t index)
 {
-    if (!draw_indexes.contains(index)) return;
+    DrawData* draw = draws.get(index);
+    if (!draw) return;
     Buffer<uint8_t> model_buffer = model->get_model_buffer();
-    for (size_t i = 0; i < model_layout.getStride(); i++)
+    memcpy(&model_data[draw->slot * model_layout.getStride()], 
+        model_buffer.data(), model_layout.getStride());
+
+    // Uploaded with the other dirty slots in update
+    dirty_models.mark(draw->slot);
+    update_sphere(draw->slot);
+    update_spatial(index);
+
+    for (size_t cluster : draw->clusters)
     {
-        model_data[draw_indexes[index] * model_layout.getStride() + i] = model_buffer[i];
+        size_t slot = draws.get(cluster)->slot;
+        memcpy(&model_data[slot * model_layout.getStride()], 
+            model_buffer.data(), model_layout.getStride());
+        dirty_models.mark(slot);
+        update_sphere(slot);
     }
-
-    bgfx::update(instances_buffer, draw_indexes[index], 
-        bgfx::makeRef(
-        &model_data[draw_indexes[index] * model_layout.getStride()], 
-        model_layout.getStride()));
 }
  
 void Batch::edit_indirect(Model* model, size_t index)
 {
-    if (!draw_indexes.contains(index) || !draw_to_instance.contains(index) 
-        || !instance_indexes.contains(draw_to_instance[index])) return;
-     
-    objs_data[draw_indexes[index]].index_start = 
-        index_buffer_usage[instance_indexes[draw_to_instance[index]]].first + 
-        model->animation_start();
-    objs_data[draw_indexes[index]].index_count = model->animation_length();
+    DrawData* draw = draws.get(index);
+    if (!draw) return;
+    InstanceData* instance = instances.get(draw->instance);
+    if (!instance) return;
 
-    update_compute = true;
+    size_t start = model->animation_start();
+    size_t count = model->animation_length();
+    if (draw->clusters.empty())
+    {
+        draw->index_start = start;
+        draw->index_count = count;
+        objs_data[draw->slot].index_start = instance->index_start + start;
+        objs_data[draw->slot].index_count = count;
+        dirty_objs.mark(draw->slot);
+        return;
+    }
 
-    bgfx::update(objs_buffer, draw_indexes[index], 
-            bgfx::makeRef(&objs_data[draw_indexes[index]], sizeof(ObjIndex)));
+    // Clusters keep their meshlet, only those inside the range are drawn
+    std::vector<size_t> clusters = draw->clusters;
+    clusters.push_back(index);
+    for (size_t handle : clusters)
+    {
+        DrawData* cluster = draws.get(handle);
+        bool inside = cluster->index_start >= start 
+            && cluster->index_start + cluster->index_count <= start + count;
+        objs_data[cluster->slot].index_start = 
+            instance->index_start + cluster->index_start;
+        objs_data[cluster->slot].index_count = 
+            inside ? cluster->index_count : 0;
+        dirty_objs.mark(cluster->slot);
+    }
 }
 
 void Batch::edit(Model* model, size_t index)
@@ -176,47 +321,150 @@ void Batch::edit(Model* model, size_t index)
 
 void Batch::remove(size_t index)
 {
+    DrawData* draw = draws.get(index);
+    if (!draw) return;
+    size_t instance_index = draw->instance;
     remove_instance(index);
-    remove_instance_data(index);
+    remove_instance_data(instance_index);
 }
 
 size_t Batch::add_instance_data(Buffer<uint8_t> vertex_buffer, 
-    Buffer<uint8_t> index_buffer)
-{
-    auto vertex_start = allocate_amount(
-        vertex_buffer.size() / vertex_layout.getStride(), size, 
-        Buffer<std::pair<size_t, size_t>>(vertex_buffer_usage.data(), 
-        vertex_buffer_usage.size()));
-    auto index_start = allocate_amount(index_buffer.size() / sizeof(uint32_t), 
-        size, Buffer<std::pair<size_t, size_t>>(index_buffer_usage.data(), 
-        index_buffer_usage.size()));
-    if (vertex_start == SIZE_MAX || index_start == SIZE_MAX) return SIZE_MAX;
-
-    bgfx::update(vbh, vertex_start, bgfx::makeRef(vertex_buffer.data(), 
-        vertex_buffer.size())); 
-    bgfx::update(ibh, index_start, bgfx::makeRef(index_buffer.data(), 
-        index_buffer.size())); 
+    Buffer<uint8_t> index_buffer, const std::vector<MeshLod>& lods)
+{
+    InstanceData data;
+    data.vertex_count = vertex_buffer.size() / vertex_layout.getStride();
+    data.index_count = index_buffer.size() / index_size;
 
-    vertex_buffer_usage.emplace_back(vertex_start, 
-        vertex_buffer.size() / vertex_layout.getStride());
+    // The handle tags the allocations so compaction can find their owner
+    size_t instance_index = instances.insert(data);
+    data.vertex_start = allocate(true, data.vertex_count, instance_index);
+    data.index_start = allocate(false, data.index_count, instance_index);
+    if (data.vertex_start == SIZE_MAX || data.index_start == SIZE_MAX) 
+    {
+        if (data.vertex_start != SIZE_MAX) 
+            vertex_allocator.free(data.vertex_start);
+        if (data.index_start != SIZE_MAX) 
+            index_allocator.free(data.index_start);
+        instances.remove(instance_index);
+        return SIZE_MAX;
+    }
+
+    // Bounding sphere, centered on the bounds (through the vertex layout so 
+    // normalized and half float positions unpack the same)
+    if (vertex_layout.has(bgfx::Attrib::Position) && data.vertex_count != 0)
+    {
+        glm::vec3 low(FLT_MAX), high(-FLT_MAX);
+        for (size_t i = 0; i < data.vertex_count; i++)
+        {
+            float position[4];
+            bgfx::vertexUnpack(position, bgfx::Attrib::Position, vertex_layout, 
+                vertex_buffer.data(), (uint32_t) i);
+            glm::vec3 point(position[0], position[1], position[2]);
+            low = glm::min(low, point);
+            high = glm::max(high, point);
+        }
+
+        glm::vec3 center = (low + high) * 0.5f;
+        float radius = 0.0f;
+        for (size_t i = 0; i < data.vertex_count; i++)
+        {
+            float position[4];
+            bgfx::vertexUnpack(position, bgfx::Attrib::Position, vertex_layout, 
+                vertex_buffer.data(), (uint32_t) i);
+            glm::vec3 point(position[0], position[1], position[2]);
+            radius = std::max(radius, glm::length(point - center));
+        }
+        data.bounds = glm::vec4(center, radius);
+    }
 
-    index_buffer_usage.emplace_back(index_start, 
-        index_buffer.size() / sizeof(uint32_t));
+    // A single level is just the index range
+    if (lods.size() > 1)
+    {
+        data.lod_start = lod_allocator.allocate(lods.size());
+        if (data.lod_start == SIZE_MAX)
+        {
+            lod_allocator.grow(std::max(lod_allocator.get_capacity() * 2, 
+                lod_allocator.get_capacity() + lods.size()));
+            lods_data.resize(lod_allocator.get_capacity());
+            data.lod_start = lod_allocator.allocate(lods.size());
+        }
+        data.lod_count = lods.size();
+
+        for (size_t i = 0; i < lods.size(); i++)
+        {
+            lods_data[data.lod_start + i] = {
+                (float) (data.index_start + lods[i].index_start), 
+                (float) lods[i].index_count, lods[i].distance};
+        }
+        lods_dirty = true;
+    }
+    *instances.get(instance_index) = data;
+
+    memcpy(&vertex_data[data.vertex_start * vertex_layout.getStride()], 
+        vertex_buffer.data(), vertex_buffer.size());
+    memcpy(&index_data[data.index_start * index_size], 
+        index_buffer.data(), index_buffer.size());
+
+    // Copied, the mesh arrays may be a cache mapping that goes away before
+    // bgfx reads them, and growing the batch moves its own arrays
+    bgfx::update(vbh, data.vertex_start, bgfx::copy(
+        &vertex_data[data.vertex_start * vertex_layout.getStride()], 
+        vertex_buffer.size())); 
+    bgfx::update(ibh, data.index_start, bgfx::copy(
+        &index_data[data.index_start * index_size], index_buffer.size())); 
 
-    size_t instance_index = current_index++;
-    instance_indexes[instance_index] = vertex_buffer_usage.size() - 1;
     return instance_index;
 }
 
-size_t Batch::add_instance(Model* model, size_t instance_index, bool new_index)
+size_t Batch::add_instance(Model* model, size_t instance_index)
+{
+    InstanceData* instance = instances.get(instance_index);
+    if (!instance) return SIZE_MAX;
+    size_t created = add_draw(model, instance_index, model->animation_start(), 
+        model->animation_length(), ClusterBounds::from(instance->bounds), true);
+    update_spatial(created);
+    return created;
+}
+
+size_t Batch::add_clusters(Model* model, size_t instance_index, 
+    const std::vector<Meshlet>& meshlets)
+{
+    if (meshlets.empty()) return add_instance(model, instance_index);
+
+    size_t head = SIZE_MAX;
+    std::vector<size_t> clusters;
+    for (const Meshlet& meshlet : meshlets)
+    {
+        size_t created = add_draw(model, instance_index, meshlet.index_start, 
+            meshlet.index_count, ClusterBounds::from(meshlet), false);
+        if (created == SIZE_MAX) break;
+        if (head == SIZE_MAX) head = created;
+        else clusters.push_back(created);
+    }
+
+    if (head == SIZE_MAX) return SIZE_MAX;
+    draws.get(head)->clusters = std::move(clusters);
+
+    // Meshlets of the frames that aren't playing stay empty
+    edit_indirect(model, head);
+    update_spatial(head);
+    return head;
+}
+
+size_t Batch::add_draw(Model* model, size_t instance_index, size_t index_start, 
+    size_t index_count, const ClusterBounds& bounds, bool lods)
 {
-    if (instance_index == SIZE_MAX) return SIZE_MAX;
+    InstanceData* instance = instances.get(instance_index);
+    if (!instance) return SIZE_MAX;
     objs_data.emplace_back(
-        (float) vertex_buffer_usage[instance_indexes[instance_index]].first, 
-        (float) vertex_buffer_usage[instance_indexes[instance_index]].second, 
-        (float) model->animation_start() + 
-        index_buffer_usage[instance_indexes[instance_index]].first, 
-        (float) model->animation_length());
+        (float) instance->vertex_start, 
+        (float) instance->vertex_count, 
+        (float) (index_start + instance->index_start), 
+        (float) index_count, 
+        (float) (lods ? instance->lod_start : 0), 
+        (float) (lods ? instance->lod_count : 0));
+    bounds_data.push_back(bounds);
+    if (depends_on_camera(objs_data.size() - 1)) camera_draws++;
 
     Buffer<uint8_t> model_buffer = model->get_model_buffer();
     for (size_t i = 0; i < model_buffer.size(); i++)
@@ -224,74 +472,212 @@ size_t Batch::add_instance(Model* model, size_t instance_index, bool new_index)
         model_data.push_back(model_buffer[i]);
     }
 
-    if (start_update == SIZE_MAX) start_update = objs_data.size() - 1;
-    end_update = objs_data.size();
+    spheres.resize(objs_data.size());
+    update_sphere(objs_data.size() - 1);
+
+    dirty_models.mark(objs_data.size() - 1);
+    dirty_objs.mark(objs_data.size() - 1);
     
-    size_t created_index = new_index ? current_index++ : instance_index;
-    draw_indexes[created_index] = objs_data.size() - 1;
-    draw_to_instance[created_index] = instance_index;
-    update_compute = true;
+    instance->draw_count++;
+    size_t created_index = draws.insert(
+        {objs_data.size() - 1, instance_index, {}, index_start, index_count});
+    draw_handles.push_back(created_index);
     return created_index;
 }
 
 void Batch::remove_instance_data(size_t index)
 {
-    if (!instance_indexes.contains(index)) return;
-    size_t index_value = instance_indexes[index];
-    vertex_buffer_usage.erase(
-        vertex_buffer_usage.begin() + instance_indexes[index]);
-    index_buffer_usage.erase(
-        index_buffer_usage.begin() + instance_indexes[index]);
-    instance_indexes.erase(index);
-    
-    for (auto& [key, value] : instance_indexes)
-    {
-        if (value > index_value) value--;
-    }
+    InstanceData* instance = instances.get(index);
+    if (!instance) return;
 
-    for (auto& [key, value] : draw_to_instance)
-    {
-        if (value == index_value) 
-            throw std::runtime_error(
+    // Checked first, a throw must leave the reference in place
+    if (instance->references == 1 && instance->draw_count != 0) 
+        throw std::runtime_error(
             "All instances must be deleted before removing the instance data!");
+    if (--instance->references != 0) return;
+
+    vertex_allocator.free(instance->vertex_start);
+    index_allocator.free(instance->index_start);
+    if (instance->lod_count != 0) lod_allocator.free(instance->lod_start);
+    instances.remove(index);
+}
+
+bool Batch::acquire_instance_data(size_t index)
+{
+    InstanceData* instance = instances.get(index);
+    if (!instance) return false;
+    instance->references++;
+    return true;
+}
+
+bool Batch::matches_instance_data(size_t index, Buffer<uint8_t> vertex_buffer, 
+    Buffer<uint8_t> index_buffer, const std::vector<MeshLod>& lods)
+{
+    InstanceData* instance = instances.get(index);
+    if (!instance) return false;
+    if (instance->vertex_count * vertex_layout.getStride() != vertex_buffer.size() 
+        || instance->index_count * index_size != index_buffer.size()) 
+        return false;
+
+    // A single level isn't stored, it is just the index range
+    if (instance->lod_count != (lods.size() > 1 ? lods.size() : 0)) 
+        return false;
+    for (size_t i = 0; i < instance->lod_count; i++)
+    {
+        const LodIndex& lod = lods_data[instance->lod_start + i];
+        if (lod.index_start != (float) (instance->index_start 
+                + lods[i].index_start)
+            || lod.index_count != (float) lods[i].index_count 
+            || lod.distance != lods[i].distance)
+            return false;
     }
+
+    return memcmp(&vertex_data[instance->vertex_start * vertex_layout.getStride()], 
+            vertex_buffer.data(), vertex_buffer.size()) == 0 
+        && memcmp(&index_data[instance->index_start * index_size], 
+            index_buffer.data(), index_buffer.size()) == 0;
 }
 
 void Batch::remove_instance(size_t index)
 {   
-    if (!draw_indexes.contains(index)) return;
-    update_compute = true;
-    refresh = true; 
-
-    objs_data.erase(objs_data.begin() + draw_indexes[index]);
+    DrawData* draw = draws.get(index);
+    if (!draw) return;
+    if (bvh) bvh->remove({this, index});
 
-    for (size_t i = 0; i < model_layout.getStride(); i++)
+    // Clusters go first, they may move the slot of this draw
+    if (!draw->clusters.empty())
     {
-        model_data.erase(
-            model_data.begin() + draw_indexes[index] * model_layout.getStride());
+        std::vector<size_t> clusters = std::move(draw->clusters);
+        for (size_t cluster : clusters) remove_instance(cluster);
+        draw = draws.get(index);
     }
 
-    size_t index_value = draw_indexes[index];
-    draw_indexes.erase(index);
-    for (auto& [key, value] : draw_indexes)
+    size_t slot = draw->slot;
+    if (depends_on_camera(slot)) camera_draws--;
+    size_t last = objs_data.size() - 1;
+    size_t stride = model_layout.getStride();
+
+    InstanceData* instance = instances.get(draw->instance);
+    if (instance) instance->draw_count--;
+
+    // Swap the last draw into the removed slot, so only that slot is uploaded
+    if (slot != last)
     {
-        if (value > index_value) value--;
+        objs_data[slot] = objs_data[last];
+        bounds_data[slot] = bounds_data[last];
+        memcpy(&model_data[slot * stride], &model_data[last * stride], stride);
+        draw_handles[slot] = draw_handles[last];
+        draws.get(draw_handles[slot])->slot = slot;
+        dirty_models.mark(slot);
+        dirty_objs.mark(slot);
     }
 
-    draw_to_instance.erase(index);
+    spheres.swap_remove(slot);
+    objs_data.pop_back();
+    bounds_data.pop_back();
+    model_data.resize(last * stride);
+    draw_handles.pop_back();
+    draws.remove(index);
 }
 
 void Batch::draw(bgfx::ViewId view, bgfx::ProgramHandle rendering_program, 
-    bgfx::Encoder* encoder)
+    bgfx::Encoder* encoder, const BindFn& bind)
 {
-    update(encoder);
-    if (!isValid(indirect_buffer)) return;
+    prepare();
+    submit(view, rendering_program, encoder, bind);
+}
+
+void Batch::submit(bgfx::ViewId view, bgfx::ProgramHandle rendering_program, 
+    bgfx::Encoder* encoder, const BindFn& bind)
+{
+    dispatch(view, encoder);
+    if (!isValid(indirect_buffer) || objs_data.empty()) return;
 
+    if (bind) bind(encoder);
     encoder->setVertexBuffer(0, vbh);
     encoder->setIndexBuffer(ibh);
     encoder->setInstanceDataBuffer(instances_buffer, 0, objs_data.size());
-    encoder->submit(view, rendering_program, indirect_buffer, (short) 0, (short) 
-        objs_data.size());
+
+    if (cpu_culling && cpu_frustum != Frustum::infinite())
+    {
+        submit_visible(view, rendering_program, encoder);
+        return;
+    }
+
+    encoder->submit(view, rendering_program, indirect_buffer, 0, 
+        (uint32_t) objs_data.size());
+}
+
+void Batch::draw_previous(bgfx::ViewId view, bgfx::ProgramHandle program, 
+    bgfx::Encoder* encoder)
+{
+    if (!isValid(indirect_buffer) || objs_data.empty()) return;
+
+    // The commands of draws changed since the last dispatch (added, swapped 
+    // into a removed slot, edited, moved by defragmenting) are stale, they 
+    // would draw other geometry with the new matrices and occlude what 
+    // shouldn't be. Only the runs of slots between them are drawn
+    size_t count = std::min(objs_data.size(), indirect_capacity);
+    std::vector<std::pair<size_t, size_t>> runs;
+    size_t start = 0;
+    dirty_objs.for_each_range(0, count, 
+        [&](size_t dirty_start, size_t dirty_end)
+    {
+        if (dirty_start > start) runs.emplace_back(start, dirty_start);
+        start = dirty_end;
+    });
+    if (count > start) runs.emplace_back(start, count);
+
+    // State is kept between the runs, and discarded by the last one
+    if (runs.empty())
+    {
+        encoder->discard();
+        return;
+    }
+
+    encoder->setVertexBuffer(0, vbh);
+    encoder->setIndexBuffer(ibh);
+    encoder->setInstanceDataBuffer(instances_buffer, 0, count);
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        encoder->submit(view, program, indirect_buffer, 
+            (uint32_t) runs[i].first, 
+            (uint32_t) (runs[i].second - runs[i].first), 0, 
+            i + 1 == runs.size() ? BGFX_DISCARD_ALL : BGFX_DISCARD_NONE);
+    }
+}
+
+void Batch::submit_visible(bgfx::ViewId view, bgfx::ProgramHandle program, 
+    bgfx::Encoder* encoder)
+{
+    Timer<std::chrono::high_resolution_clock> timer;
+    size_t count = objs_data.size();
+    size_t visible = cull_spheres(cpu_frustum, spheres, visibility);
+    stats.culled_draws += count - visible;
+    stats.cull_time += timer.get_time_ns();
+
+    // State is kept between the runs, and discarded by the last one
+    // Nothing visible still submits nothing, so the state gets discarded
+    if (visible == 0) 
+    {
+        encoder->discard();
+        return;
+    }
+
+    size_t run_start = SIZE_MAX;
+    size_t submitted = 0;
+    for (size_t slot = 0; slot <= count; slot++)
+    {
+        bool inside = slot < count && (visibility[slot / 64] >> (slot % 64)) & 1;
+        if (inside && run_start == SIZE_MAX) run_start = slot;
+        if (inside || run_start == SIZE_MAX) continue;
+
+        submitted += slot - run_start;
+        encoder->submit(view, program, indirect_buffer, (uint32_t) run_start, 
+            (uint32_t) (slot - run_start), 0, 
+            submitted == visible ? BGFX_DISCARD_ALL : BGFX_DISCARD_NONE);
+        run_start = SIZE_MAX;
+    }
 }
 
 void Batch::set_compute_program(const std::string& compute_path)
@@ -300,102 +686,384 @@ void Batch::set_compute_program(const std::string& compute_path)
     compute_program = bgfx::createProgram(load_shader(compute_path), true); 
 }
 
-void Batch::update(bgfx::Encoder* encoder)
+void Batch::set_camera_position(const glm::vec3& position)
 {
-    if (!isValid(compute_program)) return;
+    if (camera[3] == 1.0f && camera[0] == position.x 
+        && camera[1] == position.y && camera[2] == position.z) return;
+    camera[0] = position.x;
+    camera[1] = position.y;
+    camera[2] = position.z;
+    camera[3] = 1.0f;
+    camera_moved = true;
+}
 
-    if (start_update != end_update && !refresh) 
-    { 
-        bgfx::update(instances_buffer, (uint32_t) start_update, 
-            bgfx::makeRef(&model_data[start_update * model_layout.getStride()], 
-                (end_update - start_update) * model_layout.getStride()));
-        bgfx::update(objs_buffer, (uint32_t) start_update, 
-            bgfx::makeRef(&objs_data[start_update], 
-                (end_update - start_update) * sizeof(ObjIndex)));
+void Batch::set_lod_scale(float scale)
+{
+    if (lod_settings[0] == scale) return;
+    lod_settings[0] = scale;
+    camera_moved = true;
+}
+
+bool Batch::depends_on_camera(size_t slot) const
+{
+    return bounds_data[slot].sphere[3] >= 0.0f || objs_data[slot].lod_count > 1;
+}
+
+void Batch::set_frustum(const Frustum& frustum)
+{
+    if (cpu_culling)
+    {
+        cpu_frustum = frustum;
+        return;
     }
 
-    if (refresh)
+    if (this->frustum == frustum) return;
+    this->frustum = frustum;
+    camera_moved = true;
+}
+
+void Batch::set_occlusion(HiZ* hiz)
+{
+    if (this->hiz == hiz) return;
+    this->hiz = hiz;
+    camera_moved = true;
+}
+
+void Batch::set_cpu_culling(bool enabled)
+{
+    // The compute pass stops culling, the next frustums go to the cpu
+    if (enabled && !cpu_culling) set_frustum(Frustum::infinite());
+    cpu_culling = enabled;
+    cpu_frustum = Frustum::infinite();
+}
+
+bool Batch::world_sphere(size_t slot, const float* sphere, glm::vec3& center, 
+    float& radius) const
+{
+    size_t stride = model_layout.getStride();
+    if (sphere[3] < 0.0f || stride < sizeof(glm::mat4)) return false;
+
+    glm::mat4 model;
+    memcpy(&model, &model_data[slot * stride], sizeof(glm::mat4));
+    center = 
+        glm::vec3(model * glm::vec4(sphere[0], sphere[1], sphere[2], 1.0f));
+
+    // The largest axis scale, so the sphere still covers scaled models
+    float scale = glm::max(glm::length(glm::vec3(model[0])), 
+        glm::max(glm::length(glm::vec3(model[1])), 
+        glm::length(glm::vec3(model[2]))));
+    radius = sphere[3] * scale;
+    return true;
+}
+
+void Batch::update_sphere(size_t slot)
+{
+    glm::vec3 center;
+    float radius;
+    if (!world_sphere(slot, bounds_data[slot].sphere, center, radius))
     {
-        bgfx::update(instances_buffer, 0, 
-            bgfx::makeRef(model_data.data(), model_data.size()));
-        bgfx::update(objs_buffer, 0, 
-            bgfx::makeRef(objs_data.data(), objs_data.size() * sizeof(ObjIndex)));
-        refresh = false;
+        spheres.set(slot, 0.0f, 0.0f, 0.0f, FLT_MAX);
+        return;
     }
+    spheres.set(slot, center.x, center.y, center.z, radius);
+}
+
+void Batch::update_spatial(size_t index)
+{
+    if (!bvh) return;
+    DrawData* draw = draws.get(index);
+    if (!draw) return;
+    InstanceData* instance = instances.get(draw->instance);
+    if (!instance) return;
+
+    // Draws without bounds (no positions) aren't in the tree
+    glm::vec3 center;
+    float radius;
+    if (!world_sphere(draw->slot, &instance->bounds.x, center, radius)) return;
+    bvh->update({this, index}, Aabb::from_sphere(center, radius));
+}
 
-    if (update_compute)
+void Batch::set_bvh(Bvh* bvh)
+{
+    if (this->bvh)
+    {
+        for (size_t handle : draw_handles) this->bvh->remove({this, handle});
+    }
+
+    this->bvh = bvh;
+
+    // Clusters share the box of their head, so only heads are inserted
+    std::vector<size_t> clusters;
+    for (size_t handle : draw_handles)
+    {
+        DrawData* draw = draws.get(handle);
+        clusters.insert(clusters.end(), draw->clusters.begin(), 
+            draw->clusters.end());
+    }
+    std::sort(clusters.begin(), clusters.end());
+    for (size_t handle : draw_handles)
+    {
+        if (!std::binary_search(clusters.begin(), clusters.end(), handle))
+            update_spatial(handle);
+    }
+}
+
+void Batch::prepare()
+{
+    if (!isValid(compute_program)) return;
+
+    defragment();
+    upload();
+
+    if (objs_data.empty()) 
+    {
+        dirty_objs.clear();
+        return;
+    }
+
+    // Culled draws and picked lods changed, only needs a dispatch
+    // The pyramid is new every frame, so occlusion culling redoes them too
+    if ((camera_moved || hiz) && camera_draws != 0) 
+        dirty_objs.mark_range(0, objs_data.size());
+    camera_moved = false;
+
+    // Only reallocate when the draws no longer fit, growing geometrically
+    // A new buffer has no commands yet, so every draw gets regenerated
+    if (objs_data.size() > indirect_capacity)
     {
         if (isValid(indirect_buffer)) bgfx::destroy(indirect_buffer);
-        indirect_buffer = bgfx::createIndirectBuffer(objs_data.size());
-        float draw_data[4] = {float(objs_data.size()), 
-            float(bgfx::getDynamicIndexBufferOffset(ibh) / sizeof(uint32_t)), 0, 0};
+        indirect_capacity = std::max(objs_data.size(), indirect_capacity * 2);
+        indirect_buffer = bgfx::createIndirectBuffer(indirect_capacity);
+        stats.indirect_reallocations++;
+        dirty_objs.mark_range(0, objs_data.size());
+    }
+
+    index_offset = float(bgfx::getDynamicIndexBufferOffset(ibh) / index_size);
+}
+
+void Batch::dispatch(bgfx::ViewId view, bgfx::Encoder* encoder)
+{
+    if (!isValid(compute_program) || !isValid(indirect_buffer)) return;
+
+    // Regenerate the commands of the changed draws only
+    // draw_params = {end draw, index buffer offset, start draw, 0}
+    // cull_params = {camera position, 1 if set}
+    // lod_params = {lod distance scale, 0, 0, 0}
+    // frustum_planes = 6 world space planes, see Frustum
+    // occlusion_params = {pyramid width, height, mip count, 1 if enabled}
+    // occlusion_view_proj = view projection the pyramid was rendered with
+    // s_hiz = the pyramid (stage 5), see HiZ
+    // Buffers are objs (0), indirect (1), bounds (2), model data (3) and 
+    // lods (4). The bounds are moved to world space by the model matrix, 
+    // draws outside the frustum (or clusters facing away from the camera) 
+    // are written as draws of zero instances
+    float occlusion[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    if (hiz)
+    {
+        occlusion[0] = hiz->get_width();
+        occlusion[1] = hiz->get_height();
+        occlusion[2] = hiz->get_mip_count();
+        occlusion[3] = 1.0f;
+    }
+    dirty_objs.for_each_range(dispatch_gap, objs_data.size(), 
+        [&](size_t start, size_t end)
+    {
+        float draw_data[4] = {float(end), index_offset, float(start), 0};
         encoder->setUniform(draw_params, draw_data);
+        encoder->setUniform(cull_params, camera);
+        encoder->setUniform(lod_params, lod_settings);
+        encoder->setUniform(frustum_planes, frustum.planes, 6);
+        encoder->setUniform(occlusion_params, occlusion);
+        if (hiz)
+        {
+            glm::mat4 view_proj = hiz->get_view_proj();
+            encoder->setUniform(occlusion_view_proj, &view_proj);
+            encoder->setTexture(5, hiz_sampler, hiz->get_pyramid());
+        }
         encoder->setBuffer(0, objs_buffer, bgfx::Access::Read);
         encoder->setBuffer(1, indirect_buffer, bgfx::Access::Write);
-        encoder->dispatch(0, compute_program, 
-            uint32_t(objs_data.size()/64 + 1), 1, 1);
-        update_compute = false;
+        encoder->setBuffer(2, bounds_buffer, bgfx::Access::Read);
+        encoder->setBuffer(3, instances_buffer, bgfx::Access::Read);
+        encoder->setBuffer(4, lods_buffer, bgfx::Access::Read);
+        encoder->dispatch(view, compute_program, 
+            uint32_t((end - start + 63) / 64), 1, 1);
+        stats.dispatched_draws += end - start;
+    });
+    dirty_objs.clear();
+}
+
+void Batch::upload()
+{
+    size_t stride = model_layout.getStride();
+    size_t count = objs_data.size();
+
+    if (lods_dirty && !lods_data.empty())
+    {
+        bgfx::update(lods_buffer, 0, bgfx::copy(lods_data.data(), 
+            lods_data.size() * sizeof(LodIndex)));
     }
-    
-    start_update = end_update = SIZE_MAX;
+    lods_dirty = false;
+
+    // Grow the gpu buffers geometrically, everything is uploaded once
+    if (count > gpu_capacity)
+    {
+        gpu_capacity = std::max(count, gpu_capacity * 2);
+
+        const bgfx::Memory* models = bgfx::alloc(gpu_capacity * stride);
+        memset(models->data, 0, models->size);
+        memcpy(models->data, model_data.data(), model_data.size());
+        bgfx::update(instances_buffer, 0, models);
+
+        const bgfx::Memory* objs = bgfx::alloc(gpu_capacity * sizeof(ObjIndex));
+        memset(objs->data, 0, objs->size);
+        memcpy(objs->data, objs_data.data(), count * sizeof(ObjIndex));
+        bgfx::update(objs_buffer, 0, objs);
+
+        const bgfx::Memory* bounds = 
+            bgfx::alloc(gpu_capacity * sizeof(ClusterBounds));
+        memset(bounds->data, 0, bounds->size);
+        memcpy(bounds->data, bounds_data.data(), count * sizeof(ClusterBounds));
+        bgfx::update(bounds_buffer, 0, bounds);
+
+        // The objs stay dirty so their commands are regenerated
+        dirty_models.clear();
+        return;
+    }
+
+    // The cpu arrays can reallocate before the frame, so the ranges are copied
+    dirty_models.for_each_range(upload_gap, count, [&](size_t start, size_t end) 
+    {
+        bgfx::update(instances_buffer, (uint32_t) start, 
+            bgfx::copy(&model_data[start * stride], (end - start) * stride));
+    });
+
+    dirty_objs.for_each_range(upload_gap, count, [&](size_t start, size_t end) 
+    {
+        bgfx::update(objs_buffer, (uint32_t) start, 
+            bgfx::copy(&objs_data[start], (end - start) * sizeof(ObjIndex)));
+        bgfx::update(bounds_buffer, (uint32_t) start, bgfx::copy(
+            &bounds_data[start], (end - start) * sizeof(ClusterBounds)));
+    });
+
+    dirty_models.clear();
 }
 
-size_t allocate_amount(size_t amount, size_t memory_size, 
-    Buffer<std::pair<size_t, size_t>> allocated_ranges)
+void Batch::defragment()
 {
-    std::vector<std::pair<size_t, size_t>> free_ranges;
-    free_ranges.emplace_back(0, memory_size);
+    if (defragment_budget == 0) return;
 
-    for (size_t i = 0; i < allocated_ranges.size(); i++)
+    // A single free block means there are no holes to fill
+    if (vertex_allocator.free_space() == vertex_allocator.largest_free_block() 
+        && index_allocator.free_space() == index_allocator.largest_free_block())
+        return;
+
+    robin_hood::unordered_map<size_t, std::pair<int64_t, int64_t>> moved;
+    size_t used = compact_buffer(true, defragment_budget, moved);
+    if (used < defragment_budget) 
+        compact_buffer(false, defragment_budget - used, moved);
+    if (moved.empty()) return;
+
+    // Patch the lods and draws that reference moved geometry
+    for (auto& [owner, delta] : moved)
     {
-        for (size_t j = 0; j < free_ranges.size(); j++)
+        InstanceData* instance = instances.get(owner);
+        if (delta.second == 0 || instance->lod_count == 0) continue;
+        for (size_t i = 0; i < instance->lod_count; i++)
         {
-            if (allocated_ranges[i].first <= free_ranges[j].first
-                && allocated_ranges[i].first + allocated_ranges[i].second >= 
-                free_ranges[j].first + free_ranges[j].second)  
-            {
-                free_ranges.erase(free_ranges.begin() + j);              
-                continue;
-            }
-
-            if (allocated_ranges[i].first > free_ranges[j].first
-                && allocated_ranges[i].first + allocated_ranges[i].second > 
-                free_ranges[j].first + free_ranges[j].second)
-            {
-                free_ranges[j].second = allocated_ranges[i].first - 
-                    free_ranges[j].first;   
-                continue;
-            }
-
-            if (allocated_ranges[i].first <= free_ranges[j].first
-                && allocated_ranges[i].first + allocated_ranges[i].second >=
-                free_ranges[j].first)
-            {
-                free_ranges[j].first = 
-                    allocated_ranges[i].first + allocated_ranges[i].second;
-                continue;
-            }
-
-            if (allocated_ranges[i].first > free_ranges[j].first
-                && allocated_ranges[i].first + allocated_ranges[i].second < 
-                free_ranges[j].first + free_ranges[j].second)
-            {
-                free_ranges.emplace_back(
-                    allocated_ranges[i].first + allocated_ranges[i].second, 
-                    free_ranges[j].second - allocated_ranges[i].second);
-                free_ranges[j].second = 
-                    allocated_ranges[i].first - free_ranges[j].first; 
-                continue;
-            }
+            LodIndex& lod = lods_data[instance->lod_start + i];
+            lod.index_start = (float) ((int64_t) lod.index_start + delta.second);
         }
+        lods_dirty = true;
+    }
+
+    for (size_t slot = 0; slot < objs_data.size(); slot++)
+    {
+        auto it = moved.find(draws.get(draw_handles[slot])->instance);
+        if (it == moved.end()) continue;
+        ObjIndex& obj = objs_data[slot];
+        obj.vertex_start = (float) ((int64_t) obj.vertex_start + it->second.first);
+        obj.index_start = (float) ((int64_t) obj.index_start + it->second.second);
+        dirty_objs.mark(slot);
     }
 
-    size_t rval = SIZE_MAX;
+}
+
+size_t Batch::compact_buffer(bool vertices, size_t budget, 
+    robin_hood::unordered_map<size_t, std::pair<int64_t, int64_t>>& moved)
+{
+    RangeAllocator& allocator = vertices ? vertex_allocator : index_allocator;
+    std::vector<uint8_t>& data = vertices ? vertex_data : index_data;
+    size_t stride = vertices ? vertex_layout.getStride() : index_size;
+    size_t used = 0;
 
-    for (auto& range : free_ranges)
+    while (true)
     {
-        if (range.second >= amount && range.first < rval) rval = range.first;
+        // Slide the range right after the first hole down into it
+        Allocation hole = allocator.first_free_block();
+        if (hole.offset == SIZE_MAX) break;
+        Allocation next = allocator.next_allocation(hole.offset + hole.size);
+        if (next.offset == SIZE_MAX) break;
+
+        // Always allow one move, so ranges larger than the budget still move
+        size_t bytes = next.size * stride;
+        if (used != 0 && used + bytes > budget) break;
+
+        allocator.free(next.offset);
+        allocator.allocate_at(hole.offset, next.size, next.owner);
+        memmove(&data[hole.offset * stride], &data[next.offset * stride], bytes);
+
+        // The cpu copy may move again this frame, so the upload is copied
+        const bgfx::Memory* mem = bgfx::copy(&data[hole.offset * stride], bytes);
+        if (vertices) bgfx::update(vbh, hole.offset, mem);
+        else bgfx::update(ibh, hole.offset, mem);
+
+        InstanceData* instance = instances.get(next.owner);
+        if (vertices) instance->vertex_start = hole.offset;
+        else instance->index_start = hole.offset;
+        int64_t delta = (int64_t) hole.offset - (int64_t) next.offset;
+        if (vertices) moved[next.owner].first += delta;
+        else moved[next.owner].second += delta;
+
+        used += bytes;
+        if (used >= budget) break;
     }
 
-    return rval;
+    return used;
+}
+
+size_t Batch::allocate(bool vertices, size_t amount, size_t owner)
+{
+    RangeAllocator& allocator = vertices ? vertex_allocator : index_allocator;
+    size_t start = allocator.allocate(amount, owner);
+    if (start != SIZE_MAX || !grow_buffer(vertices, amount)) return start;
+    return allocator.allocate(amount, owner);
+}
+
+bool Batch::grow_buffer(bool vertices, size_t amount)
+{
+    RangeAllocator& allocator = vertices ? vertex_allocator : index_allocator;
+    std::vector<uint8_t>& data = vertices ? vertex_data : index_data;
+    size_t stride = vertices ? vertex_layout.getStride() : index_size;
+
+    // Free space at the end of the buffer is extended by the growth
+    size_t capacity = allocator.get_capacity();
+    size_t needed = capacity + std::max(amount, (size_t) 1) - 
+        allocator.trailing_free_block();
+    if (needed > max_size) return false;
+
+    size_t new_capacity = std::max(capacity, (size_t) 1);
+    while (new_capacity < needed) new_capacity *= 2;
+    new_capacity = std::min(new_capacity, max_size);
+
+    allocator.grow(new_capacity);
+    data.resize(new_capacity * stride);
+
+    // Updating past the end of a resizable buffer recreates it
+    // So the whole buffer is uploaded again from the cpu copy
+    const bgfx::Memory* mem = bgfx::copy(data.data(), data.size());
+    if (vertices) bgfx::update(vbh, 0, mem);
+    else bgfx::update(ibh, 0, mem);
+
+    stats.buffer_growths++;
+    return true;
 }
@@ -1,21 +1,37 @@
 #pragma once
 
 // internal 
+#include "model/lod.h"
+#include "model/meshlet.h"
+#include "renderer/culling.h"
+#include "renderpass/hiz.h"
 #include "util/buffer.h"
+#include "util/range_allocator.h"
+#include "util/slot_map.h"
+#include "util/dirty_set.h"
+#include "world/bvh.h"
+#include "world/frustum.h"
 
 // external
 #include <bgfx/bgfx.h>
 #include <robin-hood/robin-hood.h>
 
 // std
+#include <chrono>
+#include <functional>
 #include <string>
 #include <vector>
 #include <utility>
 #include <cstddef>
+#include <cstdint>
 
 // Forward declaration of Model
 class Model;
 
+// Binds the shared state (textures, uniforms, render state) a draw needs on 
+// the encoder it is submitted with, called right before every submit
+using BindFn = std::function<void(bgfx::Encoder*)>;
+
 // Struct & layout for storing indirect draw call data on the cpu
 struct ObjIndex 
 {
@@ -24,8 +40,15 @@ struct ObjIndex
 	float index_start;
 	float index_count;  
 
-    ObjIndex(float vs, float vc, float is, float ic) 
-        : vertex_start(vs), vertex_count(vc), index_start(is), index_count(ic) 
+    // Range of the draw's levels of detail in the lods buffer
+    // With less than two levels the index range above is drawn
+    float lod_start;
+    float lod_count;
+    float padding[2] = {0.0f, 0.0f};
+
+    ObjIndex(float vs, float vc, float is, float ic, float ls = 0, float lc = 0) 
+        : vertex_start(vs), vertex_count(vc), index_start(is), index_count(ic), 
+        lod_start(ls), lod_count(lc)
     {}
 
     static bgfx::VertexLayout layout()
@@ -35,12 +58,132 @@ struct ObjIndex
 
         layout.begin()
             .add(bgfx::Attrib::TexCoord0, 4, bgfx::AttribType::Float)
+            .add(bgfx::Attrib::TexCoord1, 4, bgfx::AttribType::Float)
+            .end();
+
+        return layout;
+    }
+};
+
+// A level of detail of an instance, the compute shader picks the last level
+// whose distance (times the lod scale) the draw is past
+struct LodIndex
+{
+    float index_start;
+    float index_count;
+    float distance;
+    float padding = 0.0f;
+
+    static bgfx::VertexLayout layout()
+    {
+        static bgfx::VertexLayout layout;
+        if (layout.getStride() != 0) return layout;
+
+        layout.begin()
+            .add(bgfx::Attrib::TexCoord0, 4, bgfx::AttribType::Float)
+            .end();
+
+        return layout;
+    }
+};
+
+// Culling data of a draw, read by the compute shader next to its ObjIndex
+// Sphere is (center, radius) and cone is (axis, cutoff), see Meshlet
+// Both are in the space of the model matrix at the start of the model data
+struct ClusterBounds
+{
+    float sphere[4];
+    float cone[4];
+
+    // Draws without a position attribute, a negative radius is never culled
+    static ClusterBounds unbounded()
+    {
+        return {{0.0f, 0.0f, 0.0f, -1.0f}, {0.0f, 0.0f, 1.0f, 1.0f}};
+    }
+
+    // Draws of whole models, only frustum culled
+    static ClusterBounds from(const glm::vec4& sphere)
+    {
+        return {{sphere.x, sphere.y, sphere.z, sphere.w}, 
+            {0.0f, 0.0f, 1.0f, 1.0f}};
+    }
+
+    static ClusterBounds from(const Meshlet& meshlet)
+    {
+        return {
+            {meshlet.center.x, meshlet.center.y, meshlet.center.z, meshlet.radius},
+            {meshlet.cone_axis.x, meshlet.cone_axis.y, meshlet.cone_axis.z, 
+                meshlet.cone_cutoff}};
+    }
+
+    static bgfx::VertexLayout layout()
+    {
+        static bgfx::VertexLayout layout;
+        if (layout.getStride() != 0) return layout;
+
+        layout.begin()
+            .add(bgfx::Attrib::TexCoord0, 4, bgfx::AttribType::Float)
+            .add(bgfx::Attrib::TexCoord1, 4, bgfx::AttribType::Float)
             .end();
 
         return layout;
     }
 };
 
+// Counters for profiling a batch
+struct BatchStats
+{
+    // Times the indirect buffer had to be recreated to fit more draws
+    size_t indirect_reallocations = 0;
+
+    // Draws whose indirect commands were regenerated by the compute shader
+    size_t dispatched_draws = 0;
+
+    // Times the vertex or index buffer grew in place
+    size_t buffer_growths = 0;
+
+    // Draws skipped by cpu culling, and the time spent culling
+    size_t culled_draws = 0;
+    std::chrono::nanoseconds cull_time = std::chrono::nanoseconds(0);
+};
+
+// Where the geometry of an instance lives in the vertex and index buffers
+struct InstanceData
+{
+    size_t vertex_start = 0;
+    size_t vertex_count = 0;
+    size_t index_start = 0;
+    size_t index_count = 0;
+
+    // Levels of detail in lods_data
+    size_t lod_start = 0;
+    size_t lod_count = 0;
+
+    // Bounding sphere of the vertices (center, radius), negative if unknown
+    glm::vec4 bounds = glm::vec4(0.0f, 0.0f, 0.0f, -1.0f);
+
+    // Number of draws using this geometry
+    size_t draw_count = 0;
+
+    // Owners of the geometry, it is freed when the last one removes it
+    size_t references = 1;
+};
+
+// A draw, its slot in objs_data/model_data and the geometry it uses
+struct DrawData
+{
+    size_t slot = 0;
+    size_t instance = SIZE_MAX;
+
+    // The other draws of a clustered model, one per meshlet after the first
+    // They share the model data and are removed with this draw
+    std::vector<size_t> clusters;
+
+    // Indices drawn, relative to the instance (the meshlet of a cluster)
+    size_t index_start = 0;
+    size_t index_count = 0;
+};
+
 class Batch 
 {
 private:
@@ -57,10 +200,17 @@ private:
     // Contains vertex & index offsets and counts
     std::vector<ObjIndex> objs_data;
 
-    // Allocation data for the vertex and index buffers
-    // This is the way the data is layed out on the gpu
-    std::vector<std::pair<size_t, size_t>> vertex_buffer_usage;
-    std::vector<std::pair<size_t, size_t>> index_buffer_usage;
+    // Free space tracking for the vertex and index buffers
+    RangeAllocator vertex_allocator;
+    RangeAllocator index_allocator;
+
+    // Cpu copies of the vertex and index buffers
+    // Used to move ranges around when compacting the buffers
+    std::vector<uint8_t> vertex_data;
+    std::vector<uint8_t> index_data;
+
+    // Bytes of geometry that may be moved per frame when compacting (0 is off)
+    size_t defragment_budget = 0;
 
     // The model instance data, such as matrices and textures
     // Only used for removal of models, since adding models doesn't require a whole buffer rewrite
@@ -69,44 +219,119 @@ private:
     // Objs buffer
     bgfx::DynamicVertexBufferHandle objs_buffer;
 
+    // Culling bounds of each draw, parallel to objs_data
+    std::vector<ClusterBounds> bounds_data;
+    bgfx::DynamicVertexBufferHandle bounds_buffer;
+
+    // Levels of detail of the instances, ranges handed out by lod_allocator
+    // Uploaded whole when they change, they are tiny next to the draws
+    std::vector<LodIndex> lods_data;
+    RangeAllocator lod_allocator;
+    bgfx::DynamicVertexBufferHandle lods_buffer;
+    bool lods_dirty = false;
+
+    // Camera position for the cluster cone test, w is 1 once it has been set
+    bgfx::UniformHandle cull_params;
+    float camera[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+    // World space frustum the draws are culled against, the planes of 
+    // Frustum::infinite when the view isn't culled
+    bgfx::UniformHandle frustum_planes;
+    Frustum frustum = Frustum::infinite();
+
+    // Cpu culling, for backends or views where the compute pass can't be 
+    // relied on. The world space spheres of the draws are kept next to 
+    // model_data, the frustum is tested on the cpu and only visible runs of 
+    // the indirect buffer are submitted (the gpu frustum stays infinite)
+    bool cpu_culling = false;
+    Frustum cpu_frustum = Frustum::infinite();
+    SphereSoA spheres;
+    std::vector<uint64_t> visibility;
+
+    // Occlusion culling against the Hi-Z pyramid of last frame's visible draws
+    // The pyramid changes every frame, so every command is regenerated
+    HiZ* hiz = nullptr;
+    bgfx::UniformHandle occlusion_params;
+    bgfx::UniformHandle occlusion_view_proj;
+    bgfx::UniformHandle hiz_sampler;
+
+    // Spatial index the draws' world space bounds are kept in (nullptr is off)
+    // Keyed by draw handle, clusters are covered by the box of their head
+    Bvh* bvh = nullptr;
+
+    // Level of detail settings, {distance scale, 0, 0, 0}
+    bgfx::UniformHandle lod_params;
+    float lod_settings[4] = {1.0f, 0.0f, 0.0f, 0.0f};
+
+    // Clusters and levels of detail depend on the camera, so those draws are 
+    // regenerated every frame it moves (as long as the batch has any)
+    bool camera_moved = false;
+    size_t camera_draws = 0;
+
     // Layout of the model data
     bgfx::VertexLayout model_layout;
 
     // Instances buffer (cpu populated)
     bgfx::DynamicVertexBufferHandle instances_buffer;
  
-    // Indirect buffer
+    // Indirect buffer, reused across frames until the draws outgrow it
     bgfx::IndirectBufferHandle indirect_buffer;
+    size_t indirect_capacity = 0;
 
     // The compute shader that loads the indirect buffer
     bgfx::ProgramHandle compute_program;
 
-    // Update compute
-    bool update_compute = false;
+    // Offset of the index buffer (in indices), read in prepare so the 
+    // dispatch doesn't touch the resource api
+    float index_offset = 0.0f;
+
+    // Clean draws allowed between two changed ones before the indirect
+    // compute is split into another dispatch
+    size_t dispatch_gap = 256;
 
     // Size of batch (in number of vertices)
     size_t size;
 
-    // Instance indexes contain the indexes into the buffers (such as start vertex etc.)
-    // Draw indexes contain the indexes into pretty much everything else
-    // Also the current last index into the map
-    robin_hood::unordered_map<size_t, size_t> instance_indexes;
-    robin_hood::unordered_map<size_t, size_t> draw_indexes;
-    robin_hood::unordered_map<size_t, size_t> draw_to_instance;
-    size_t current_index = 0;
+    // The vertex and index buffers double in place up to this size
+    // Keep it below 2^24, the ObjIndex offsets are stored as floats
+    size_t max_size = 0;
+
+    // Bytes per index, 16 bit batches only hold meshes of up to 65536 vertices
+    // Indices are relative to the mesh, the draws offset them by vertex_start
+    uint32_t index_size = sizeof(uint32_t);
+
+    // Instances hold the geometry (such as start vertex etc.)
+    // Draws hold the slot into pretty much everything else
+    // The handles given out by the batch are handles into these
+    SlotMap<InstanceData> instances;
+    SlotMap<DrawData> draws;
+
+    // The draw handle of each slot in objs_data, for swap removal
+    std::vector<size_t> draw_handles;
 
     // A uniform to send the draw parameters to the compute shader
     bgfx::UniformHandle draw_params;
 
-    // Some parameters to tell the update function how the buffers should be updated
-    size_t start_update;
-    size_t end_update;
-    bool refresh;
+    // Slots of model_data and objs_data that changed since the last update
+    // They are uploaded once per frame, coalesced into contiguous ranges
+    // Dirty objs also have their indirect commands regenerated
+    DirtySet dirty_models;
+    DirtySet dirty_objs;
+
+    // Clean slots allowed between two dirty ones before the upload is split
+    size_t upload_gap = 16;
+
+    // Number of draws the gpu side instance and objs buffers can hold
+    size_t gpu_capacity = 0;
+
+    // Profiling counters
+    BatchStats stats;
 public:
     Batch();
     explicit Batch(size_t size, const std::string& compute_path, 
         const bgfx::VertexLayout& vertex_layout, 
-        const bgfx::VertexLayout& model_layout);
+        const bgfx::VertexLayout& model_layout, size_t max_size = 0, 
+        uint32_t index_size = sizeof(uint32_t));
     Batch(const Batch& other) = delete;
     Batch& operator=(const Batch& other) = delete;
     Batch(Batch&& other) noexcept;
@@ -117,33 +342,151 @@ public:
     size_t add(Model* model);
     void edit(Model* model, size_t index);
     void edit_model_data(Model* model, size_t index);
+
+    // Points the draw at the model's animation range, the clusters of a
+    // clustered draw keep their meshlet and only those inside it are drawn
     void edit_indirect(Model*, size_t model_index);
+
     void remove(size_t index);
 
     // Instance adding
+    // Lods are ranges of index_buffer, draws of the instance pick one by 
+    // distance to the camera
     size_t add_instance_data(Buffer<uint8_t> vertex_buffer, 
-        Buffer<uint8_t> index_buffer);
-    size_t add_instance(Model* model, size_t instance_index, 
-        bool new_index = true);
+        Buffer<uint8_t> index_buffer, const std::vector<MeshLod>& lods = {});
+    size_t add_instance(Model* model, size_t instance_index);
+
+    // Draw the instance as one indirect draw per meshlet
+    // The compute shader drops the clusters that face away from the camera
+    // Returns a handle that edits and removes every cluster at once
+    size_t add_clusters(Model* model, size_t instance_index, 
+        const std::vector<Meshlet>& meshlets);
     void remove_instance_data(size_t index);
     void remove_instance(size_t index);
 
-    // Texture list should have been bound before
+    // Share existing instance data, released with remove_instance_data
+    bool acquire_instance_data(size_t index);
+
+    // If the instance holds exactly this geometry and levels of detail
+    bool matches_instance_data(size_t index, Buffer<uint8_t> vertex_buffer, 
+        Buffer<uint8_t> index_buffer, const std::vector<MeshLod>& lods);
+
+    // Prepare and submit in one go, on the api thread
+    // Bind is called after the compute dispatch (which discards the encoder 
+    // state), so textures bound there reach the draw
     void draw(bgfx::ViewId view, bgfx::ProgramHandle rendering_program, 
-        bgfx::Encoder* encoder);
+        bgfx::Encoder* encoder, const BindFn& bind = nullptr);
+
+    // Drawing in two halves, so batches can be submitted from worker threads
+    // 1. prepare uploads the changed data and (re)allocates the buffers, it 
+    //    uses the bgfx resource api so it must run on the api thread
+    // 2. submit dispatches the indirect compute and submits the draws, it 
+    //    only touches this batch and the encoder, so different batches may 
+    //    be submitted at the same time with one encoder per thread
+    void prepare();
+    void submit(bgfx::ViewId view, bgfx::ProgramHandle rendering_program, 
+        bgfx::Encoder* encoder, const BindFn& bind = nullptr);
 
     // Change/add a compute progam 
     void set_compute_program(const std::string& compute_path);
+
+    // World space camera position, used to cull clusters and pick lods
+    void set_camera_position(const glm::vec3& position);
+
+    // Multiplies the distance each level of detail starts at
+    void set_lod_scale(float scale);
+
+    // Frustum the following draws are culled against (Frustum::infinite to 
+    // stop culling), drawing into views with different frustums regenerates
+    // every command for each of them
+    void set_frustum(const Frustum& frustum);
+
+    // Cull against the frustum on the cpu instead of in the compute pass
+    void set_cpu_culling(bool enabled);
+
+    // Test the draws against the pyramid in the compute pass (nullptr is off)
+    // The pyramid has to be built before the batch is drawn
+    void set_occlusion(HiZ* hiz);
+
+    // Keep the world space bounds of every draw in the tree, the draws 
+    // already in the batch are inserted right away
+    void set_bvh(Bvh* bvh);
+
+    // Draws the commands generated last frame without regenerating them
+    // Culled draws have no instances, so this draws last frame's visible set
+    // Draws changed since then are skipped until they are dispatched again
+    void draw_previous(bgfx::ViewId view, bgfx::ProgramHandle program, 
+        bgfx::Encoder* encoder);
+
+    const BatchStats& get_stats() const { return stats; }
+    uint32_t get_index_size() const { return index_size; }
+
+    // Largest vertex/index ranges that fit without growing the batch
+    size_t largest_free_vertices() const 
+    { 
+        return vertex_allocator.largest_free_block(); 
+    }
+    size_t largest_free_indices() const 
+    { 
+        return index_allocator.largest_free_block(); 
+    }
+
+    // Dirty slots closer than gap are uploaded together in one update
+    void set_upload_gap(size_t gap) { upload_gap = gap; }
+
+    // Incrementally move geometry towards the front of the buffers
+    // At most bytes_per_frame are moved each update, 0 disables it
+    void set_defragment_budget(size_t bytes_per_frame) 
+    { 
+        defragment_budget = bytes_per_frame; 
+    }
 private:
-    // Do all updates to the objs data and model data
-    // Update the batch renderer
-    // Run the compute shader (if needed)
-    void update(bgfx::Encoder* encoder);
+    // Run the compute shader over the changed draws (if any)
+    // The commands are generated in the view they are drawn in
+    void dispatch(bgfx::ViewId view, bgfx::Encoder* encoder);
+
+    // Upload the dirty model and objs data
+    void upload();
+
+    // Adds a draw of part of the instance's indices (relative to the instance)
+    // Lods selects the instance's levels of detail instead of that range
+    size_t add_draw(Model* model, size_t instance_index, size_t index_start, 
+        size_t index_count, const ClusterBounds& bounds, bool lods);
+
+    // If the command of the draw in slot changes with the camera
+    bool depends_on_camera(size_t slot) const;
+
+    // Moves a local sphere into world space with the model matrix of slot
+    // The model matrix is the start of the model data, false if there is none
+    // or the sphere is unknown (negative radius)
+    bool world_sphere(size_t slot, const float* sphere, glm::vec3& center, 
+        float& radius) const;
+
+    // Moves the bounds of the draw in slot into world space for cpu culling
+    void update_sphere(size_t slot);
+
+    // Moves the draw's box in the bvh to the instance bounds in world space
+    void update_spatial(size_t index);
+
+    // Submits the runs of visible draws, after culling them on the cpu
+    void submit_visible(bgfx::ViewId view, bgfx::ProgramHandle program, 
+        bgfx::Encoder* encoder);
+
+    // Allocate vertices or indices, growing the buffer if they don't fit
+    size_t allocate(bool vertices, size_t amount, size_t owner);
+
+    // Grow the vertex or index buffer so amount more units fit at its end
+    bool grow_buffer(bool vertices, size_t amount);
+
+    // Move live ranges into the holes before them, within the frame budget
+    void defragment();
+
+    // Compacts either the vertex or index buffer, returns the bytes moved
+    // Moved contains the offset change of each instance that was moved
+    size_t compact_buffer(bool vertices, size_t budget, 
+        robin_hood::unordered_map<size_t, std::pair<int64_t, int64_t>>& moved);
 
     // Get the start of the vertex and index buffers for a new model being added
     std::pair<size_t, size_t> get_start_in_buffers(size_t num_vertices, 
         size_t num_indices);
 };
-
-size_t allocate_amount(size_t amount, size_t memory_size, 
-        Buffer<std::pair<size_t, size_t>> allocated_ranges);
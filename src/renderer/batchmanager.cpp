@@ -3,20 +3,26 @@
 // internal
 #include "core/shader.h"
 #include "util/util.h"
+#include "model/mesh.h"
 #include "global.h"
 
 // external
 #include <bimg/bimg.h>
 #include <bimg/decode.h>
 
+// std
+#include <algorithm>
+#include <atomic>
+
 BatchManager::BatchManager(bgfx::VertexLayout layout, 
     bgfx::VertexLayout model_layout, const std::string& compute_path, 
-    size_t size)
+    size_t size, size_t max_size)
 {
     this->layout = layout;
     this->model_layout = model_layout;
     this->compute_path = compute_path;
     this->batch_size = size;
+    this->max_batch_size = max_size;
     this->batches.resize(0);
 }
 
@@ -27,44 +33,262 @@ BatchManager::~BatchManager()
 
 std::pair<Batch*, size_t> BatchManager::add(Model* model)
 {
-    for (auto& batch : batches)
+    // The draw owns the reference to the instance data, remove releases it
+    auto [batch, instance] = add_instance_data(model->get_vertex_buffer(), 
+        model->get_index_buffer(), model->index_size(), model->get_lods());
+    if (instance == SIZE_MAX) return {batch, SIZE_MAX};
+    if (!model->get_meshlets().empty()) 
+        return {batch, batch->add_clusters(model, instance, model->get_meshlets())};
+    return {batch, batch->add_instance(model, instance)};
+}
+
+std::pair<Batch*, size_t> BatchManager::add_instance_data(
+    Buffer<uint8_t> vertex_buffer, Buffer<uint8_t> index_buffer, 
+    uint32_t index_size, const std::vector<MeshLod>& lods)
+{
+    // Meshes with 16 bit indices go to 16 bit batches
+    index_size = index_size == sizeof(uint16_t) ? 
+        sizeof(uint16_t) : sizeof(uint32_t);
+
+    // The levels are part of the key, the same geometry loaded with other
+    // lod distances must not share them (a single level isn't stored)
+    size_t hash = robin_hood::hash_bytes(vertex_buffer.data(), 
+        vertex_buffer.size()) ^ (robin_hood::hash_bytes(index_buffer.data(), 
+        index_buffer.size()) * 0x9E3779B97F4A7C15ull) ^ index_size;
+    for (size_t i = 0; lods.size() > 1 && i < lods.size(); i++)
+    {
+        size_t fields[2] = {lods[i].index_start, lods[i].index_count};
+        hash = (hash * 0x9E3779B97F4A7C15ull) 
+            ^ robin_hood::hash_bytes(fields, sizeof(fields))
+            ^ robin_hood::hash_bytes(&lods[i].distance, sizeof(float));
+    }
+
+    auto existing = geometry.find(hash);
+    if (existing != geometry.end())
     {
-        size_t rval = batch.add(model);
+        auto [id, instance] = existing->second;
+        if (batches[id].get_index_size() == index_size 
+            && batches[id].matches_instance_data(instance, vertex_buffer, 
+                index_buffer, lods) 
+            && batches[id].acquire_instance_data(instance))
+            return {&batches[id], instance};
+        
+        // Freed since, or a hash collision
+        geometry.erase(existing);
+    }
+
+    size_t vertices = vertex_buffer.size() / layout.getStride();
+    size_t indices = index_buffer.size() / index_size;
+    for (size_t id : candidates(vertices, indices, index_size))
+    {
+        size_t rval = batches[id].add_instance_data(vertex_buffer, 
+            index_buffer, lods);
+        refresh_summary(id);
         if (rval == SIZE_MAX) continue;
-        return {&batch, rval};
+        geometry[hash] = {id, rval};
+        return {&batches[id], rval};
     }
 
-    batches.emplace_back(batch_size, compute_path, layout, model_layout);
-    return {&batches.back(), batches.back().add(model)};
+    Batch& batch = create_batch(index_size);
+    size_t rval = batch.add_instance_data(vertex_buffer, index_buffer, lods);
+    refresh_summary(batches.size() - 1);
+    if (rval != SIZE_MAX) geometry[hash] = {batches.size() - 1, rval};
+    return {&batch, rval};
 }
 
-std::pair<Batch*, size_t> BatchManager::add_instance_data(
-    Buffer<uint8_t> vertex_buffer, Buffer<uint8_t> index_buffer)
+void BatchManager::queue_upload(std::function<void()> upload)
+{
+    std::lock_guard<std::mutex> lock(uploads_mutex);
+    uploads.push_back(std::move(upload));
+}
+
+void BatchManager::flush_uploads()
+{
+    // Swapped out first, an upload may queue another one
+    std::vector<std::function<void()>> queued;
+    {
+        std::lock_guard<std::mutex> lock(uploads_mutex);
+        queued.swap(uploads);
+    }
+    for (auto& upload : queued) upload();
+}
+
+void BatchManager::set_defragment_budget(size_t bytes_per_frame)
+{
+    defragment_budget = bytes_per_frame;
+    for (auto& batch : batches) batch.set_defragment_budget(bytes_per_frame);
+}
+
+void BatchManager::set_upload_gap(size_t gap)
+{
+    upload_gap = gap;
+    for (auto& batch : batches) batch.set_upload_gap(gap);
+}
+
+void BatchManager::set_camera_position(const glm::vec3& position)
+{
+    camera_position = position;
+    for (auto& batch : batches) batch.set_camera_position(position);
+}
+
+void BatchManager::set_view_frustum(bgfx::ViewId view, const Frustum& frustum)
+{
+    frustums[view] = frustum;
+}
+
+void BatchManager::clear_view_frustum(bgfx::ViewId view)
+{
+    frustums.erase(view);
+}
+
+void BatchManager::set_cpu_culling(bool enabled)
 {
+    cpu_culling = enabled;
+    for (auto& batch : batches) batch.set_cpu_culling(enabled);
+}
+
+void BatchManager::set_occlusion(HiZ* hiz, bgfx::ViewId view)
+{
+    this->hiz = hiz;
+    occlusion_view = view;
+}
+
+void BatchManager::draw_occluders(SubpassManager& passes, const glm::mat4& view, 
+    const glm::mat4& projection, bgfx::ProgramHandle depth_program)
+{
+    if (!hiz) return;
+
+    bgfx::ViewId id = hiz->begin_depth(passes, view, projection);
+    bgfx::Encoder* encoder = bgfx::begin();
+    for (auto& batch : batches) 
+    {
+        encoder->setState(BGFX_STATE_WRITE_Z | BGFX_STATE_DEPTH_TEST_LESS 
+            | BGFX_STATE_CULL_CW);
+        batch.draw_previous(id, depth_program, encoder);
+    }
+    bgfx::end(encoder);
+
+    hiz->build(passes);
+}
+
+void BatchManager::set_lod_scale(float scale)
+{
+    lod_scale = scale;
+    for (auto& batch : batches) batch.set_lod_scale(scale);
+}
+
+BatchStats BatchManager::get_stats() const
+{
+    BatchStats total;
     for (auto& batch : batches)
     {
-        size_t rval = batch.add_instance_data(vertex_buffer, index_buffer);
-        if (rval == SIZE_MAX) continue;
-        return {&batch, rval};
+        total.indirect_reallocations += batch.get_stats().indirect_reallocations;
+        total.dispatched_draws += batch.get_stats().dispatched_draws;
+        total.buffer_growths += batch.get_stats().buffer_growths;
+        total.culled_draws += batch.get_stats().culled_draws;
+        total.cull_time += batch.get_stats().cull_time;
     }
+    return total;
+}
 
-    batches.emplace_back(batch_size, compute_path, layout, model_layout);
-    return {&batches.back(), 
-        batches.back().add_instance_data(vertex_buffer, index_buffer)};
+Batch& BatchManager::create_batch(uint32_t index_size)
+{
+    batches.emplace_back(batch_size, compute_path, layout, model_layout, 
+        max_batch_size, index_size);
+    batches.back().set_defragment_budget(defragment_budget);
+    batches.back().set_upload_gap(upload_gap);
+    batches.back().set_lod_scale(lod_scale);
+    batches.back().set_cpu_culling(cpu_culling);
+    batches.back().set_bvh(&bvh);
+    if (camera_position) batches.back().set_camera_position(*camera_position);
+    summaries.emplace_back(SIZE_MAX, SIZE_MAX);
+    newest_batches[batches.back().get_index_size()] = batches.size() - 1;
+    return batches.back();
+}
+
+std::vector<size_t> BatchManager::candidates(size_t vertices, size_t indices, 
+    uint32_t index_size)
+{
+    std::vector<size_t> rval;
+
+    // Smallest vertex block that fits among those with enough indices
+    size_t best = free_index.find(index_size, vertices, indices);
+    if (best != SIZE_MAX) rval.push_back(best);
+
+    // The newest batch with the same index size
+    auto newest = newest_batches.find(index_size);
+    if (newest != newest_batches.end() 
+        && (rval.empty() || rval[0] != newest->second)) 
+        rval.push_back(newest->second);
+    return rval;
+}
+
+void BatchManager::refresh_summary(size_t batch)
+{
+    std::pair<size_t, size_t> summary = {
+        batches[batch].largest_free_vertices(), 
+        batches[batch].largest_free_indices()};
+    if (summaries[batch] == summary) return;
+
+    uint32_t index_size = batches[batch].get_index_size();
+    free_index.erase(index_size, summaries[batch].first, batch);
+    free_index.insert(index_size, summary.first, summary.second, batch);
+    summaries[batch] = summary;
 }
 
 void BatchManager::draw(bgfx::ViewId view, bgfx::ProgramHandle program, 
-    bgfx::Encoder* encoder)
+    const BindFn& bind)
 {
-    // Bind textures and set render state
-    // Multithreaded drawing
-    // Potentially evolve onto more complex structure?
-    if (!encoder) encoder = bgfx::begin();
+    // Meshes loaded in the background go in before anything is prepared
+    flush_uploads();
+
+    // Models moved since last frame may have left the tree worth rebuilding
+    bvh.maintain();
 
+    // Everything that goes through the resource api happens here
+    auto frustum = frustums.find(view);
     for (auto& batch : batches)
     {
-        batch.draw(view, program, encoder);
+        batch.set_frustum(frustum != frustums.end() ? 
+            frustum->second : Frustum::infinite());
+        batch.set_occlusion(view == occlusion_view ? hiz : nullptr);
+        batch.prepare();
     }
 
+    size_t threads = draw_threads;
+    if (threads == 0) threads = global->jobs->worker_count() + 1;
+    threads = std::min({threads, batches.size(), 
+        (size_t) bgfx::getCaps()->limits.maxEncoders});
+
+    // Workers take the next batch until none are left, so a few large 
+    // batches don't leave the other threads idle
+    std::atomic<size_t> next = 0;
+    auto work = [&](bgfx::Encoder* encoder)
+    {
+        for (size_t id = next++; id < batches.size(); id = next++)
+            batches[id].submit(view, program, encoder, bind);
+    };
+
+    // One job per extra thread, the calling thread takes part with its own 
+    // encoder before helping with the jobs
+    JobCounter submitted;
+    for (size_t i = 1; i < threads; i++)
+    {
+        global->jobs->run([&]()
+        {
+            // Out of encoders, the other threads pick up the slack
+            bgfx::Encoder* encoder = bgfx::begin(true);
+            if (!encoder) return;
+            work(encoder);
+            bgfx::end(encoder);
+        }, &submitted);
+    }
+
+    bgfx::Encoder* encoder = bgfx::begin();
+    work(encoder);
     bgfx::end(encoder);
+    global->jobs->wait(submitted);
+
+    // Models remove themselves from their batch directly
+    for (size_t id = 0; id < batches.size(); id++) refresh_summary(id);
 }
@@ -2,23 +2,52 @@
 
 // internal
 #include "util/buffer.h"
+#include "util/fit_index.h"
 #include "batch.h"
 
 // external
 #include <bgfx/bgfx.h>
+#include <robin-hood/robin-hood.h>
 
 // std
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <vector>
 
 class BatchManager
 {   
 private:
+    // World space bounds of every draw, declared before the batches so it 
+    // outlives them
+    Bvh bvh;
+
     // List of batches 
-    std::vector<Batch> batches;
+    // A deque so the batch pointers handed to models stay valid
+    std::deque<Batch> batches;
+
+    // Free space index, the largest free vertex and index block of every 
+    // batch grouped by index size, so placement is an O(log n) best fit 
+    // lookup instead of trying every batch. Summaries holds the blocks each 
+    // batch is currently indexed with
+    FitIndex free_index;
+    std::vector<std::pair<size_t, size_t>> summaries;
+
+    // Newest batch of each index size, tried when nothing fits as it can grow
+    robin_hood::unordered_map<uint32_t, size_t> newest_batches;
+
+    // Uploaded geometry by content hash -> (batch, instance handle)
+    // Identical geometry is shared, the batch refcounts the instance data
+    // Entries whose instance has since been freed are dropped on lookup
+    robin_hood::unordered_map<size_t, std::pair<size_t, size_t>> geometry;
 
     // Size of each batch (number of vertices / indices allocated)
     size_t batch_size;
+
+    // Size each batch may grow to before a new batch is created
+    size_t max_batch_size;
     
     // Computer shader path (file path)
     std::string compute_path;
@@ -27,10 +56,52 @@ private:
     bgfx::VertexLayout layout;
     bgfx::VertexLayout model_layout;
 
+    // Bytes of geometry each batch may move per frame when compacting
+    size_t defragment_budget = 0;
+
+    // Gap between dirty slots that still gets merged into one upload
+    size_t upload_gap = 16;
+
+    // Camera used to cull clusters, given to batches created later too
+    std::optional<glm::vec3> camera_position;
+
+    // Multiplies the distance at which every level of detail starts
+    float lod_scale = 1.0f;
+
+    // Frustum of each culled view, views without one aren't culled
+    robin_hood::unordered_map<bgfx::ViewId, Frustum> frustums;
+
+    // Cull the frustums on the cpu instead of in the compute pass
+    bool cpu_culling = false;
+
+    // Hi-Z pyramid the draws are occlusion culled against (nullptr is off), 
+    // and the view of the camera it was built for, the only one culled
+    HiZ* hiz = nullptr;
+    bgfx::ViewId occlusion_view = 0;
+
+    // Threads the batches are submitted from, 0 uses every job worker
+    size_t draw_threads = 0;
+
+    // Uploads queued from other threads, run at the start of draw
+    std::mutex uploads_mutex;
+    std::vector<std::function<void()>> uploads;
+
+    // Creates a new batch with the manager's settings
+    Batch& create_batch(uint32_t index_size);
+
+    // Batches to try for a new allocation, in order
+    // The best fit without growing (O(log n) in the number of batches), then
+    // the newest batch (which can grow)
+    std::vector<size_t> candidates(size_t vertices, size_t indices, 
+        uint32_t index_size);
+
+    // Update the free space index entry of a batch
+    void refresh_summary(size_t batch);
 public:
     // Constructor
     BatchManager(bgfx::VertexLayout layout, bgfx::VertexLayout model_layout, 
-        const std::string& compute_path, size_t size = 100000);
+        const std::string& compute_path, size_t size = 100000, 
+        size_t max_size = 1600000);
     
     ~BatchManager();
 
@@ -39,13 +110,80 @@ public:
     BatchManager& operator=(const BatchManager& other) = delete;
 
     // Add a model to a batch 
+    // Geometry that is already uploaded is shared instead of uploaded again
     std::pair<Batch*, size_t> add(Model* model);
 
     // Add data for a new instance to a batch (so you can make instances out of it)
+    // Identical data returns the existing instance with another reference
+    // Index size is the width of the index buffer (2 or 4 bytes)
+    // Lods are ranges of the index buffer the compute shader picks from
     std::pair<Batch*, size_t> add_instance_data(Buffer<uint8_t> vertex_buffer, 
-        Buffer<uint8_t> index_buffer);
+        Buffer<uint8_t> index_buffer, uint32_t index_size = sizeof(uint32_t), 
+        const std::vector<MeshLod>& lods = {});
+
+    // Queue work that changes the batches (add, add_instance_data, ...)
+    // from any thread, it runs on the api thread at the start of draw
+    void queue_upload(std::function<void()> upload);
+
+    // Runs the queued uploads now, draw calls it first
+    void flush_uploads();
+
+    // Enable background compaction of the batches (0 disables it)
+    // Fragmented batches move up to bytes_per_frame of geometry each frame
+    void set_defragment_budget(size_t bytes_per_frame);
+
+    // Set how many clean slots may be merged into a dirty upload range
+    void set_upload_gap(size_t gap);
+
+    // World space camera position, clusters facing away from it are culled
+    void set_camera_position(const glm::vec3& position);
+
+    // Cull the draws of a view against the frustum (see Camera::get_frustum)
+    void set_view_frustum(bgfx::ViewId view, const Frustum& frustum);
+    void clear_view_frustum(bgfx::ViewId view);
+
+    // Test the view frustums on the cpu (SIMD over the draws' spheres) and 
+    // submit only the visible draws, for when the compute pass can't cull
+    void set_cpu_culling(bool enabled);
+
+    // Occlusion culling, in two phases each frame
+    // 1. draw_occluders renders last frame's visible draws depth only and 
+    //    builds the Hi-Z pyramid from them
+    // 2. draw tests every draw against the pyramid in the batch compute
+    // Draws that come into view show up a frame late
+    // The pyramid is the depth of one camera, so only the draws of view are
+    // tested against it (other views, like shadows, aren't). Set it again 
+    // whenever that camera is drawn in another view
+    void set_occlusion(HiZ* hiz, bgfx::ViewId view);
+
+    // Phase 1, call it before allocating the views the batches are drawn in 
+    // (the SubpassManager views run in order). View and projection are 
+    // those of the camera the batches are drawn with
+    void draw_occluders(SubpassManager& passes, const glm::mat4& view, 
+        const glm::mat4& projection, bgfx::ProgramHandle depth_program);
+
+    // Scale the level of detail distances (above 1 keeps detail for longer)
+    void set_lod_scale(float scale);
+
+    // Spatial index over every draw, for frustum, sphere and ray queries 
+    // Items are (batch, draw handle), as returned by add
+    // Kept up to date as models move, rebuilt when needed at the start of draw
+    Bvh& get_bvh() { return bvh; }
+    const Bvh& get_bvh() const { return bvh; }
+
+    // Stats summed over every batch
+    BatchStats get_stats() const;
+
+    // Threads draw submits the batches from (the calling one included)
+    // Capped by the batch count and the encoders bgfx has, 1 is serial
+    void set_draw_threads(size_t threads) { draw_threads = threads; }
 
-    // Draw all of the batches, with other info added to the encoder
+    // Draw all of the batches, call from the api thread
+    // The uploads run first on the calling thread, then the batches are split 
+    // over the draw threads, each dispatching and submitting with its own 
+    // encoder. Shared state (the texture atlas, uniforms, render state) goes 
+    // in bind, which is called on the encoder before every batch's submit. 
+    // It runs on the worker threads, so it may only touch the encoder it gets
     void draw(bgfx::ViewId view, bgfx::ProgramHandle rendering_program, 
-        bgfx::Encoder* encoder = nullptr);
+        const BindFn& bind = nullptr);
 };
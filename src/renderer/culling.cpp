@@ -0,0 +1,133 @@
+#include "culling.h"
+
+// std
+#include <bit>
+
+#if (defined(__x86_64__) || defined(_M_X64) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define CULLING_X86 1
+#include <immintrin.h>
+#endif
+
+// Scalar test of spheres [start, end), or'd into the visibility words
+static void cull_range_scalar(const Frustum& frustum, const SphereSoA& spheres,
+    size_t start, size_t end, uint64_t* visibility)
+{
+    for (size_t i = start; i < end; i++)
+    {
+        bool inside = true;
+        for (auto& plane : frustum.planes)
+        {
+            float distance = plane.x * spheres.x[i] + plane.y * spheres.y[i] +
+                plane.z * spheres.z[i] + plane.w;
+            inside &= distance >= -spheres.radius[i];
+        }
+        visibility[i / 64] |= (uint64_t) inside << (i % 64);
+    }
+}
+
+#ifdef CULLING_X86
+// 4 spheres at a time, SSE is always there on x86-64
+static void cull_range_sse(const Frustum& frustum, const SphereSoA& spheres,
+    size_t count, uint64_t* visibility)
+{
+    __m128 planes[6][4];
+    for (int p = 0; p < 6; p++)
+    {
+        for (int c = 0; c < 4; c++) 
+            planes[p][c] = _mm_set1_ps(frustum.planes[p][c]);
+    }
+
+    size_t blocks = count / 4 * 4;
+    for (size_t i = 0; i < blocks; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(&spheres.x[i]);
+        __m128 y = _mm_loadu_ps(&spheres.y[i]);
+        __m128 z = _mm_loadu_ps(&spheres.z[i]);
+        __m128 radius = _mm_loadu_ps(&spheres.radius[i]);
+        __m128 negative_radius = _mm_sub_ps(_mm_setzero_ps(), radius);
+
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int p = 0; p < 6; p++)
+        {
+            __m128 distance = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(planes[p][0], x), _mm_mul_ps(planes[p][1], y)),
+                _mm_add_ps(_mm_mul_ps(planes[p][2], z), planes[p][3]));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negative_radius));
+        }
+
+        visibility[i / 64] |= (uint64_t) _mm_movemask_ps(inside) << (i % 64);
+    }
+
+    cull_range_scalar(frustum, spheres, blocks, count, visibility);
+}
+
+// 8 spheres at a time, only called when the cpu supports it
+__attribute__((target("avx2,fma")))
+static void cull_range_avx2(const Frustum& frustum, const SphereSoA& spheres,
+    size_t count, uint64_t* visibility)
+{
+    __m256 planes[6][4];
+    for (int p = 0; p < 6; p++)
+    {
+        for (int c = 0; c < 4; c++)
+            planes[p][c] = _mm256_set1_ps(frustum.planes[p][c]);
+    }
+
+    size_t blocks = count / 8 * 8;
+    for (size_t i = 0; i < blocks; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(&spheres.x[i]);
+        __m256 y = _mm256_loadu_ps(&spheres.y[i]);
+        __m256 z = _mm256_loadu_ps(&spheres.z[i]);
+        __m256 radius = _mm256_loadu_ps(&spheres.radius[i]);
+        __m256 negative_radius = _mm256_sub_ps(_mm256_setzero_ps(), radius);
+
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int p = 0; p < 6; p++)
+        {
+            __m256 distance = _mm256_fmadd_ps(planes[p][0], x, planes[p][3]);
+            distance = _mm256_fmadd_ps(planes[p][1], y, distance);
+            distance = _mm256_fmadd_ps(planes[p][2], z, distance);
+            inside = _mm256_and_ps(inside,
+                _mm256_cmp_ps(distance, negative_radius, _CMP_GE_OQ));
+        }
+
+        visibility[i / 64] |= (uint64_t) _mm256_movemask_ps(inside) << (i % 64);
+    }
+
+    cull_range_scalar(frustum, spheres, blocks, count, visibility);
+}
+#endif
+
+static size_t count_visible(const std::vector<uint64_t>& visibility)
+{
+    size_t visible = 0;
+    for (uint64_t word : visibility) visible += std::popcount(word);
+    return visible;
+}
+
+size_t cull_spheres(const Frustum& frustum, const SphereSoA& spheres,
+    std::vector<uint64_t>& visibility)
+{
+    visibility.assign((spheres.size() + 63) / 64, 0);
+
+#ifdef CULLING_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2") &&
+        __builtin_cpu_supports("fma");
+    if (avx2) cull_range_avx2(frustum, spheres, spheres.size(), visibility.data());
+    else cull_range_sse(frustum, spheres, spheres.size(), visibility.data());
+#else
+    cull_range_scalar(frustum, spheres, 0, spheres.size(), visibility.data());
+#endif
+
+    return count_visible(visibility);
+}
+
+size_t cull_spheres_scalar(const Frustum& frustum, const SphereSoA& spheres,
+    std::vector<uint64_t>& visibility)
+{
+    visibility.assign((spheres.size() + 63) / 64, 0);
+    cull_range_scalar(frustum, spheres, 0, spheres.size(), visibility.data());
+    return count_visible(visibility);
+}
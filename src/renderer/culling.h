@@ -0,0 +1,57 @@
+#pragma once
+
+// internal
+#include "world/frustum.h"
+
+// std
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// World space bounding spheres of the draws of a batch, one array per
+// component so the culling kernel loads several spheres at a time
+struct SphereSoA
+{
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    std::vector<float> radius;
+
+    size_t size() const { return x.size(); }
+
+    void resize(size_t count)
+    {
+        x.resize(count);
+        y.resize(count);
+        z.resize(count);
+        radius.resize(count);
+    }
+
+    void set(size_t index, float sx, float sy, float sz, float sr)
+    {
+        x[index] = sx;
+        y[index] = sy;
+        z[index] = sz;
+        radius[index] = sr;
+    }
+
+    // Moves the last sphere into index, then drops the last
+    void swap_remove(size_t index)
+    {
+        size_t last = size() - 1;
+        set(index, x[last], y[last], z[last], radius[last]);
+        resize(last);
+    }
+};
+
+// Tests every sphere against the six planes of the frustum
+// Bit i of visibility (64 spheres per word) is set when sphere i is at least
+// partly inside, visibility is resized to fit. Picks AVX2 or SSE at runtime
+// on x86 and falls back to scalar code elsewhere
+// Returns the number of visible spheres
+size_t cull_spheres(const Frustum& frustum, const SphereSoA& spheres,
+    std::vector<uint64_t>& visibility);
+
+// The scalar kernel, bench/cull_spheres.cpp checks cull_spheres against it
+size_t cull_spheres_scalar(const Frustum& frustum, const SphereSoA& spheres,
+    std::vector<uint64_t>& visibility);
@@ -0,0 +1,104 @@
+#include "hiz.h"
+
+// internal
+#include "core/shader.h"
+
+// std
+#include <algorithm>
+
+HiZ::HiZ(uint16_t width, uint16_t height, const std::string& downsample_path)
+{
+    this->width = width;
+    this->height = height;
+    downsample_program = bgfx::createProgram(load_shader(downsample_path), true);
+    hiz_params = bgfx::createUniform("hiz_params", bgfx::UniformType::Vec4);
+    depth_sampler = bgfx::createUniform("s_depth", bgfx::UniformType::Sampler);
+    create();
+}
+
+HiZ::~HiZ()
+{
+    destroy();
+    if (bgfx::isValid(downsample_program)) bgfx::destroy(downsample_program);
+    if (bgfx::isValid(hiz_params)) bgfx::destroy(hiz_params);
+    if (bgfx::isValid(depth_sampler)) bgfx::destroy(depth_sampler);
+}
+
+void HiZ::create()
+{
+    // Every mip down to 1x1, sized like bgfx sizes them (halved, rounded down)
+    // The shader folds the odd texel at the edge into the last one
+    mip_count = 1;
+    for (uint16_t size = std::max(width, height); size > 1; size /= 2) 
+        mip_count++;
+
+    depth = bgfx::createTexture2D(width, height, false, 1,
+        bgfx::TextureFormat::D32F, BGFX_TEXTURE_RT);
+    depth_buffer = bgfx::createFrameBuffer(1, &depth, false);
+    pyramid = bgfx::createTexture2D(width, height, true, 1,
+        bgfx::TextureFormat::R32F, BGFX_TEXTURE_COMPUTE_WRITE |
+        BGFX_SAMPLER_POINT | BGFX_SAMPLER_UVW_CLAMP);
+}
+
+void HiZ::destroy()
+{
+    if (bgfx::isValid(depth_buffer)) bgfx::destroy(depth_buffer);
+    if (bgfx::isValid(depth)) bgfx::destroy(depth);
+    if (bgfx::isValid(pyramid)) bgfx::destroy(pyramid);
+}
+
+void HiZ::resize(uint16_t width, uint16_t height)
+{
+    if (this->width == width && this->height == height) return;
+    destroy();
+    this->width = width;
+    this->height = height;
+    create();
+}
+
+bgfx::ViewId HiZ::begin_depth(SubpassManager& passes, const glm::mat4& view,
+    const glm::mat4& projection)
+{
+    bgfx::ViewId id = passes.get_pass(depth_buffer);
+    bgfx::setViewRect(id, 0, 0, width, height);
+    bgfx::setViewClear(id, BGFX_CLEAR_DEPTH, 0, 1.0f, 0);
+    bgfx::setViewTransform(id, &view, &projection);
+    view_proj = projection * view;
+    return id;
+}
+
+void HiZ::build(SubpassManager& passes)
+{
+    // Compute only views, so each mip waits for the one before it
+    // Reserved up front, getting a pass can call frame() and that must not
+    // happen while the encoder is open
+    bgfx::ViewId first = passes.get_passes(mip_count, BGFX_INVALID_HANDLE);
+    bgfx::Encoder* encoder = bgfx::begin();
+
+    uint16_t mip_width = width;
+    uint16_t mip_height = height;
+    uint16_t source_width = width;
+    uint16_t source_height = height;
+    for (uint8_t mip = 0; mip < mip_count; mip++)
+    {
+        bgfx::ViewId id = first + mip;
+
+        float params[4] = {float(source_width), float(source_height),
+            float(mip), mip == 0 ? 1.0f : 0.0f};
+        encoder->setUniform(hiz_params, params);
+        if (mip == 0) encoder->setTexture(0, depth_sampler, depth);
+        else encoder->setImage(0, pyramid, mip - 1, bgfx::Access::Read,
+            bgfx::TextureFormat::R32F);
+        encoder->setImage(1, pyramid, mip, bgfx::Access::Write,
+            bgfx::TextureFormat::R32F);
+        encoder->dispatch(id, downsample_program, (mip_width + 7) / 8,
+            (mip_height + 7) / 8, 1);
+
+        source_width = mip_width;
+        source_height = mip_height;
+        mip_width = std::max(1, mip_width / 2);
+        mip_height = std::max(1, mip_height / 2);
+    }
+
+    bgfx::end(encoder);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+// internal
+#include "renderpass/renderpass.h"
+
+// external
+#include <bgfx/bgfx.h>
+#include <glm/glm.hpp>
+
+// std
+#include <cstdint>
+#include <string>
+
+// Hierarchical depth buffer for occlusion culling
+// Occluders (last frame's visible draws) are rendered depth only, then a
+// compute pass reduces the depth into a mip pyramid of the farthest depth.
+// The batch compute projects each draw's bounds, picks the mip where they
+// cover a couple of texels and skips the draw if it is behind all of them
+//
+// The downsample shader gets hiz_params = {source width, source height,
+// mip being written, 1 for the first mip}. The first mip reads the depth
+// texture (s_depth, stage 0), the others read mip - 1 of the pyramid
+// (image 0), and the mip is written to image 1 (R32F)
+class HiZ
+{
+private:
+    uint16_t width = 0;
+    uint16_t height = 0;
+    uint8_t mip_count = 0;
+
+    // Occluder depth, rendered into by the depth view
+    bgfx::TextureHandle depth;
+    bgfx::FrameBufferHandle depth_buffer;
+
+    // Farthest depth of each texel of each mip
+    bgfx::TextureHandle pyramid;
+
+    bgfx::ProgramHandle downsample_program;
+    bgfx::UniformHandle hiz_params;
+    bgfx::UniformHandle depth_sampler;
+
+    // View projection the depth was rendered with
+    glm::mat4 view_proj = glm::mat4(1.0f);
+
+    void create();
+    void destroy();
+public:
+    HiZ(uint16_t width, uint16_t height, const std::string& downsample_path);
+    HiZ(const HiZ& other) = delete;
+    HiZ& operator=(const HiZ& other) = delete;
+    ~HiZ();
+
+    // Recreate the textures for a new backbuffer size
+    void resize(uint16_t width, uint16_t height);
+
+    // Allocates and clears the depth only view the occluders are drawn in
+    bgfx::ViewId begin_depth(SubpassManager& passes, const glm::mat4& view,
+        const glm::mat4& projection);
+
+    // Reduces the occluder depth into the pyramid, one compute view per mip
+    void build(SubpassManager& passes);
+
+    bgfx::TextureHandle get_pyramid() const { return pyramid; }
+    glm::mat4 get_view_proj() const { return view_proj; }
+    uint16_t get_width() const { return width; }
+    uint16_t get_height() const { return height; }
+    uint8_t get_mip_count() const { return mip_count; }
+};
@@ -18,6 +18,19 @@ public:
         return current++;
     }
 
+    // Create count temporary passes with consecutive ids, returns the first
+    // Renders first if they don't fit, so call it before opening an encoder
+    inline bgfx::ViewId get_passes(uint16_t count,
+        bgfx::FrameBufferHandle handle)
+    {
+        if (current + count > 255) render();
+        for (uint16_t i = 0; i < count; i++)
+            setViewFrameBuffer(bgfx::ViewId(current + i), handle);
+        bgfx::ViewId first = current;
+        current += count;
+        return first;
+    }
+
     // Render
     inline void render() 
     {
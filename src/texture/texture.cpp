@@ -8,6 +8,9 @@
 #include <bimg/decode.h>
 #include <bgfx/bgfx.h>
 
+// std
+#include <stdexcept>
+
 Texture::Texture()
 {
     // empty
@@ -21,8 +24,12 @@ Texture::Texture(const std::string& filepath)
 
 void Texture::load_image(const std::string& filepath)
 {
-    raw_data = read_file_raw(filepath);
-    image_container = bimg::imageParse(global->allocator, raw_data->data, raw_data->size);
+    // Parsed straight out of the mapping, bimg copies what it keeps
+    MappedFile file;
+    if (!file.open(filepath, MappedFile::SEQUENTIAL)) 
+        throw std::runtime_error("Cannot find file " + filepath);
+    image_container = bimg::imageParse(global->allocator, file.data(), 
+        (uint32_t) file.size());
 }
 
 static void img_free(void*, void* img_container)
@@ -35,7 +42,6 @@ void Texture::create_handle(uint64_t flags)
     if(!bgfx::isTextureValid(0, false, image_container->m_numLayers, bgfx::TextureFormat::Enum(image_container->m_format), flags)) return;
     texture_handle = bgfx::createTexture2D(image_container->m_width, image_container->m_height, 1 < image_container->m_numMips, image_container->m_numLayers, bgfx::TextureFormat::Enum(image_container->m_format), flags, bgfx::makeRef(
 					  image_container->m_data, image_container->m_size, img_free, image_container));
-    bx::free(global->allocator, raw_data);
     valid_handle = true;
 }
 
@@ -77,6 +83,13 @@ TextureAtlas::TextureAtlas(uint16_t width, uint16_t height,
 
 TextureAtlas::~TextureAtlas()
 {
+    // Decodes still running write into decoded
+    global->jobs->wait(decoding);
+    for (auto& layer : decoded) 
+    {
+        if (layer.image) bimg::imageFree(layer.image);
+    }
+
     if (bgfx::isValid(texture_handle)) bgfx::destroy(texture_handle);
     if (bgfx::isValid(texture_sampler)) bgfx::destroy(texture_sampler);
 }
@@ -84,27 +97,131 @@ TextureAtlas::~TextureAtlas()
 uint16_t TextureAtlas::load_texture(const std::string& path)
 {
     if (mapped_paths.contains(path)) return mapped_paths[path];
-    mapped_paths[path] = num_images_used;
     
-    auto* raw_data = read_file_raw(path);  
+    MappedFile file;
+    if (!file.open(path, MappedFile::SEQUENTIAL)) 
+        throw std::runtime_error("Cannot find file " + path);
     auto image_container = bimg::imageParse(global->allocator, 
-        raw_data->data, raw_data->size);
+        file.data(), (uint32_t) file.size());
+    if (!image_container) 
+        throw std::runtime_error("Cannot decode image " + path);
+
+    // Mapped once it is in, a failed load doesn't leave the path behind
+    upload_layer(num_images_used, image_container);
+    mapped_paths[path] = num_images_used;
+
+    return num_images_used++;
+}
+
+void TextureAtlas::forget_layer(const std::string& path, uint16_t layer)
+{
+    auto existing = mapped_paths.find(path);
+    if (existing != mapped_paths.end() && existing->second == layer) 
+        mapped_paths.erase(existing);
+}
 
-    if (image_container->m_width != width || image_container->m_height != height) 
+void TextureAtlas::upload_layer(uint16_t layer, bimg::ImageContainer* image)
+{
+    if (image->m_width != width || image->m_height != height) 
+    {
+        bimg::imageFree(image);
         throw std::runtime_error("Bad image being added to batch renderer");
+    }
 
-    bgfx::updateTexture2D(this->texture_handle, num_images_used, 0, 0, 0, 
-        image_container->m_width, image_container->m_height, 
-        bgfx::makeRef(image_container->m_data, image_container->m_size, 
-        img_free, image_container));
-    bx::free(global->allocator, raw_data);
+    bgfx::updateTexture2D(this->texture_handle, layer, 0, 0, 0, 
+        image->m_width, image->m_height, 
+        bgfx::makeRef(image->m_data, image->m_size, img_free, image));
+}
 
-    return num_images_used++;
+std::vector<uint16_t> TextureAtlas::load_textures(
+    const std::vector<std::string>& paths)
+{
+    std::vector<uint16_t> ids;
+    ids.reserve(paths.size());
+    for (auto& path : paths)
+    {
+        auto existing = mapped_paths.find(path);
+        if (existing != mapped_paths.end())
+        {
+            ids.push_back(existing->second);
+            continue;
+        }
+
+        if (num_images_used >= num_images) 
+            throw std::runtime_error("Texture atlas is full");
+        uint16_t layer = num_images_used++;
+        mapped_paths[path] = layer;
+        ids.push_back(layer);
+        pending++;
+
+        // Only the file and the allocator are touched off the api thread
+        global->jobs->run([this, layer, path]()
+        {
+            DecodedLayer result = {layer, path, nullptr, ""};
+            try
+            {
+                MappedFile file;
+                if (!file.open(path, MappedFile::SEQUENTIAL)) 
+                    throw std::runtime_error("Cannot find file " + path);
+                result.image = bimg::imageParse(global->allocator, 
+                    file.data(), (uint32_t) file.size());
+                if (!result.image) result.error = "Cannot decode image " + path;
+            }
+            catch (const std::exception& e)
+            {
+                result.error = e.what();
+            }
+
+            std::lock_guard<std::mutex> lock(decoded_mutex);
+            decoded.push_back(std::move(result));
+        }, &decoding);
+    }
+
+    return ids;
+}
+
+size_t TextureAtlas::flush()
+{
+    std::vector<DecodedLayer> ready;
+    {
+        std::lock_guard<std::mutex> lock(decoded_mutex);
+        ready.swap(decoded);
+    }
+
+    std::string error;
+    for (auto& layer : ready)
+    {
+        pending--;
+        if (!layer.image)
+        {
+            forget_layer(layer.path, layer.layer);
+            if (error.empty()) error = layer.error;
+            continue;
+        }
+
+        try
+        {
+            upload_layer(layer.layer, layer.image);
+        }
+        catch (const std::exception& e)
+        {
+            forget_layer(layer.path, layer.layer);
+            if (error.empty()) error = std::string(e.what()) + " (" 
+                + layer.path + ")";
+        }
+    }
+
+    if (!error.empty()) throw std::runtime_error(error);
+    return pending;
+}
+
+void TextureAtlas::finish()
+{
+    global->jobs->wait(decoding);
+    flush();
 }
 
-bgfx::Encoder* TextureAtlas::bind(bgfx::Encoder* encoder)
+void TextureAtlas::bind(bgfx::Encoder* encoder) const
 {
-    if (!encoder) encoder = bgfx::begin();
     encoder->setTexture(stage, texture_sampler, texture_handle);
-    return encoder;
 }
@@ -1,19 +1,23 @@
 #pragma once
 
+// internal
+#include "util/jobs.h"
+
 // external
 #include <bimg/bimg.h>
 #include <bgfx/bgfx.h>
 #include <robin-hood/robin-hood.h>
 
 // std
+#include <mutex>
 #include <string>
+#include <vector>
 
 class Texture
 {
 private:
     bgfx::TextureHandle texture_handle;
     bimg::ImageContainer* image_container;
-    bgfx::Memory* raw_data;
     bgfx::UniformHandle sampler_uniform;
 
     bool valid_handle = false;
@@ -51,6 +55,27 @@ private:
     // Texture slot
     uint16_t stage;
 
+    // Layers decoded on the job system, waiting for flush to upload them
+    struct DecodedLayer
+    {
+        uint16_t layer;
+        std::string path;
+        bimg::ImageContainer* image;
+        std::string error;
+    };
+    std::mutex decoded_mutex;
+    std::vector<DecodedLayer> decoded;
+    JobCounter decoding;
+
+    // Layers reserved by load_textures that haven't been uploaded yet
+    size_t pending = 0;
+
+    // Uploads one decoded image into its layer, frees it if it doesn't fit
+    void upload_layer(uint16_t layer, bimg::ImageContainer* image);
+
+    // Forgets the path of a layer that couldn't be loaded, so looking it up 
+    // again loads it instead of returning the empty layer
+    void forget_layer(const std::string& path, uint16_t layer);
 public:
     TextureAtlas();
     explicit TextureAtlas(uint16_t width, uint16_t height, 
@@ -62,6 +87,22 @@ public:
     // Load a texture from a path
     uint16_t load_texture(const std::string& path);
 
+    // Load many textures at once, the ids are returned right away (paths 
+    // already loaded or loading keep theirs). The files are read and decoded 
+    // in parallel on the job system, flush uploads them once they are done
+    std::vector<uint16_t> load_textures(const std::vector<std::string>& paths);
+
+    // Uploads the layers decoded so far, call it on the api thread (once a 
+    // frame while textures are loading). Returns the layers still decoding
+    // Throws after uploading the rest if an image couldn't be loaded, its
+    // path is forgotten (the layer stays unused)
+    size_t flush();
+
+    // Waits for every layer to be decoded and uploads them
+    void finish();
+
     // Bind these textures to an encoder
-    bgfx::Encoder* bind(bgfx::Encoder* encoder = nullptr);
+    // Encoders are per thread and drop their bindings on every submit, so 
+    // bind from the callback given to BatchManager::draw
+    void bind(bgfx::Encoder* encoder) const;
 };
@@ -0,0 +1,90 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Marks dirty elements of an array in a bitset
+// The dirty elements are handed back as coalesced [start, end) ranges
+class DirtySet
+{
+private:
+    std::vector<uint64_t> bits;
+
+    // Range of words that have bits set, to avoid scanning the whole set
+    size_t low = SIZE_MAX;
+    size_t high = 0;
+public:
+    void mark(size_t index)
+    {
+        size_t word = index / 64;
+        if (word >= bits.size()) bits.resize(word + 1, 0);
+        bits[word] |= uint64_t(1) << (index % 64);
+        low = std::min(low, word);
+        high = std::max(high, word + 1);
+    }
+
+    // Whole words at a time
+    void mark_range(size_t start, size_t end)
+    {
+        if (start >= end) return;
+        size_t first = start / 64;
+        size_t last = (end - 1) / 64;
+        if (last >= bits.size()) bits.resize(last + 1, 0);
+        for (size_t w = first; w <= last; w++)
+        {
+            uint64_t mask = ~uint64_t(0);
+            if (w == first) mask &= ~uint64_t(0) << (start % 64);
+            if (w == last && end % 64) mask &= ~uint64_t(0) >> (64 - end % 64);
+            bits[w] |= mask;
+        }
+        low = std::min(low, first);
+        high = std::max(high, last + 1);
+    }
+
+    bool empty() const { return low == SIZE_MAX; }
+
+    void clear()
+    {
+        if (empty()) return;
+        std::fill(bits.begin() + low, bits.begin() + high, 0);
+        low = SIZE_MAX;
+        high = 0;
+    }
+
+    // Calls fn(start, end) for every dirty range below limit
+    // Ranges separated by at most gap clean elements are merged into one
+    template <typename F>
+    void for_each_range(size_t gap, size_t limit, F&& fn) const
+    {
+        if (empty()) return;
+
+        size_t start = SIZE_MAX;
+        size_t end = 0;
+        size_t last_word = std::min(high, (limit + 63) / 64);
+        for (size_t w = low; w < last_word; w++)
+        {
+            uint64_t word = bits[w];
+            while (word)
+            {
+                size_t i = w * 64 + std::countr_zero(word);
+                word &= word - 1;
+                if (i >= limit) break;
+
+                if (start != SIZE_MAX && i - end > gap)
+                {
+                    fn(start, end);
+                    start = SIZE_MAX;
+                }
+
+                if (start == SIZE_MAX) start = i;
+                end = i + 1;
+            }
+        }
+
+        if (start != SIZE_MAX) fn(start, end);
+    }
+};
@@ -0,0 +1,119 @@
+#include "fit_index.h"
+
+// std
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+void FitIndex::update(Node* node)
+{
+    node->max_second = node->second;
+    if (node->left)
+        node->max_second = std::max(node->max_second, node->left->max_second);
+    if (node->right)
+        node->max_second = std::max(node->max_second, node->right->max_second);
+}
+
+void FitIndex::split(std::unique_ptr<Node> node, const Key& key,
+    std::unique_ptr<Node>& below, std::unique_ptr<Node>& rest)
+{
+    if (!node)
+    {
+        below.reset();
+        rest.reset();
+        return;
+    }
+
+    if (node->key < key)
+    {
+        split(std::move(node->right), key, node->right, rest);
+        update(node.get());
+        below = std::move(node);
+    }
+    else
+    {
+        split(std::move(node->left), key, below, node->left);
+        update(node.get());
+        rest = std::move(node);
+    }
+}
+
+std::unique_ptr<FitIndex::Node> FitIndex::merge(std::unique_ptr<Node> left,
+    std::unique_ptr<Node> right)
+{
+    if (!left) return right;
+    if (!right) return left;
+
+    if (left->priority > right->priority)
+    {
+        left->right = merge(std::move(left->right), std::move(right));
+        update(left.get());
+        return left;
+    }
+    right->left = merge(std::move(left), std::move(right->left));
+    update(right.get());
+    return right;
+}
+
+void FitIndex::insert(uint32_t group, size_t first, size_t second, size_t id)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    std::unique_ptr<Node> node = std::make_unique<Node>();
+    node->key = {group, first, id};
+    node->second = node->max_second = second;
+    node->priority = seed;
+
+    std::unique_ptr<Node> below;
+    std::unique_ptr<Node> rest;
+    split(std::move(root), node->key, below, rest);
+    root = merge(merge(std::move(below), std::move(node)), std::move(rest));
+}
+
+void FitIndex::erase(uint32_t group, size_t first, size_t id)
+{
+    Key key = {group, first, id};
+    std::unique_ptr<Node> below;
+    std::unique_ptr<Node> rest;
+    split(std::move(root), key, below, rest);
+
+    // The entry is the leftmost node of rest, if it is there
+    std::unique_ptr<Node>* slot = &rest;
+    std::vector<Node*> path;
+    while (*slot && (*slot)->left)
+    {
+        path.push_back(slot->get());
+        slot = &(*slot)->left;
+    }
+    if (*slot && (*slot)->key == key)
+    {
+        *slot = std::move((*slot)->right);
+        for (size_t i = path.size(); i-- > 0;) update(path[i]);
+    }
+
+    root = merge(std::move(below), std::move(rest));
+}
+
+const FitIndex::Node* FitIndex::find(const Node* node, const Key& key,
+    size_t second)
+{
+    // Subtrees where nothing is large enough are skipped whole, so this
+    // only walks the path to key and one path down to the fit
+    if (!node || node->max_second < second) return nullptr;
+    if (node->key < key) return find(node->right.get(), key, second);
+
+    const Node* found = find(node->left.get(), key, second);
+    if (found) return found;
+    if (node->second >= second) return node;
+    return find(node->right.get(), key, second);
+}
+
+size_t FitIndex::find(uint32_t group, size_t min_first,
+    size_t min_second) const
+{
+    const Node* node = find(root.get(), {group, min_first, 0}, min_second);
+    if (!node || std::get<0>(node->key) != group) return SIZE_MAX;
+    return std::get<2>(node->key);
+}
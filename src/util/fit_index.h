@@ -0,0 +1,61 @@
+#pragma once
+
+// std
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <tuple>
+
+// Entries with two free sizes (first, second), grouped by a tag
+// Finds the entry of a group with the smallest first size that fits both
+// sizes in O(log n). A treap ordered by (group, first, id), where every node
+// also holds the largest second size of its subtree, so subtrees without
+// a fit are skipped whole
+class FitIndex
+{
+private:
+    using Key = std::tuple<uint32_t, size_t, size_t>;
+
+    struct Node
+    {
+        Key key;
+        size_t second;
+        uint32_t priority;
+
+        // Largest second size in this subtree
+        size_t max_second;
+
+        std::unique_ptr<Node> left;
+        std::unique_ptr<Node> right;
+    };
+
+    std::unique_ptr<Node> root;
+
+    // Xorshift state for the priorities
+    uint32_t seed = 2463534242u;
+
+    static void update(Node* node);
+
+    // Splits node into the keys below key and the rest
+    static void split(std::unique_ptr<Node> node, const Key& key,
+        std::unique_ptr<Node>& below, std::unique_ptr<Node>& rest);
+    static std::unique_ptr<Node> merge(std::unique_ptr<Node> left,
+        std::unique_ptr<Node> right);
+
+    // Leftmost node with a key of at least key and second of at least second
+    static const Node* find(const Node* node, const Key& key, size_t second);
+public:
+    FitIndex() = default;
+    FitIndex(const FitIndex& other) = delete;
+    FitIndex& operator=(const FitIndex& other) = delete;
+
+    // Ids must be unique within a group and first size
+    void insert(uint32_t group, size_t first, size_t second, size_t id);
+
+    // Removes the entry inserted with these values, if there is one
+    void erase(uint32_t group, size_t first, size_t id);
+
+    // Id of the entry of group with the smallest first size where
+    // first >= min_first and second >= min_second, SIZE_MAX if none fits
+    size_t find(uint32_t group, size_t min_first, size_t min_second) const;
+};
@@ -0,0 +1,191 @@
+#include "jobs.h"
+
+// Queue of the worker running on this thread, SIZE_MAX on other threads
+static thread_local size_t worker_index = SIZE_MAX;
+
+JobSystem::JobSystem(size_t worker_count)
+{
+    start(worker_count);
+}
+
+JobSystem::~JobSystem()
+{
+    stop();
+}
+
+size_t JobSystem::default_worker_count()
+{
+    size_t cores = std::thread::hardware_concurrency();
+    return cores > 1 ? cores - 1 : 0;
+}
+
+void JobSystem::set_worker_count(size_t worker_count)
+{
+    if (worker_count == workers.size()) return;
+    stop();
+    start(worker_count);
+}
+
+void JobSystem::start(size_t worker_count)
+{
+    queues.clear();
+    for (size_t i = 0; i <= worker_count; i++)
+        queues.push_back(std::make_unique<Queue>());
+
+    running = true;
+    for (size_t i = 0; i < worker_count; i++)
+        workers.emplace_back(&JobSystem::worker_loop, this, i);
+}
+
+void JobSystem::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        running = false;
+    }
+    wake.notify_all();
+    for (auto& worker : workers) worker.join();
+    workers.clear();
+
+    // Whatever is left runs here, jobs may still queue more
+    Task task;
+    while (try_pop(task)) execute(task);
+}
+
+void JobSystem::worker_loop(size_t index)
+{
+    worker_index = index;
+    while (true)
+    {
+        Task task;
+        if (try_pop(task))
+        {
+            execute(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wake.wait(lock, [&]() { return queued.load() != 0 || !running; });
+        if (!running) break;
+    }
+    worker_index = SIZE_MAX;
+}
+
+void JobSystem::push(Task task)
+{
+    size_t index = worker_index < queues.size() ?
+        worker_index : queues.size() - 1;
+    {
+        std::lock_guard<std::mutex> lock(queues[index]->mutex);
+        queues[index]->tasks.push_back(std::move(task));
+    }
+
+    // Taking the lock orders this with a worker about to sleep
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        queued++;
+    }
+    wake.notify_one();
+}
+
+bool JobSystem::try_pop(Task& task, const JobCounter* only)
+{
+    if (queued.load() == 0) return false;
+
+    // Takes the task at it, if it is one the caller may run
+    auto take = [&](Queue& queue, std::deque<Task>::iterator it)
+    {
+        if (only && it->counter != only) return false;
+        task = std::move(*it);
+        queue.tasks.erase(it);
+        queued--;
+        return true;
+    };
+
+    // Own jobs newest first, they are the most likely to still be in cache
+    size_t own = worker_index < queues.size() ?
+        worker_index : queues.size() - 1;
+    {
+        Queue& queue = *queues[own];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        for (size_t i = queue.tasks.size(); i-- > 0;)
+            if (take(queue, queue.tasks.begin() + i)) return true;
+    }
+
+    // Steal the oldest job of the next queue that has one
+    for (size_t i = 1; i < queues.size(); i++)
+    {
+        Queue& victim = *queues[(own + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        for (auto it = victim.tasks.begin(); it != victim.tasks.end(); it++)
+            if (take(victim, it)) return true;
+    }
+
+    return false;
+}
+
+void JobSystem::execute(Task& task)
+{
+    task.job();
+    finish(task.counter);
+}
+
+void JobSystem::finish(JobCounter* counter)
+{
+    if (!counter) return;
+
+    // Under the lock, so wait can't return (and the counter be destroyed) 
+    // while it is still being used here
+    std::vector<JobCounter::Continuation> continuations;
+    {
+        std::lock_guard<std::mutex> lock(counter->mutex);
+        if (--counter->pending != 0) return;
+        continuations.swap(counter->continuations);
+    }
+    for (auto& continuation : continuations)
+        schedule({std::move(continuation.job), continuation.counter});
+}
+
+void JobSystem::schedule(Task task)
+{
+    // Without workers the caller would only run it when it waits
+    if (workers.empty()) execute(task);
+    else push(std::move(task));
+}
+
+void JobSystem::run(Job job, JobCounter* counter)
+{
+    if (counter) counter->pending++;
+    schedule({std::move(job), counter});
+}
+
+void JobSystem::run_after(JobCounter& dependency, Job job, JobCounter* counter)
+{
+    // Counted from now, so waiting on counter also waits for the dependency
+    if (counter) counter->pending++;
+    {
+        std::lock_guard<std::mutex> lock(dependency.mutex);
+        if (!dependency.done())
+        {
+            dependency.continuations.push_back({std::move(job), counter});
+            return;
+        }
+    }
+
+    schedule({std::move(job), counter});
+}
+
+void JobSystem::wait(JobCounter& counter)
+{
+    // A worker has to run anything, the jobs it waits on may depend on others
+    const JobCounter* only = worker_index < workers.size() ? nullptr : &counter;
+    while (!counter.done())
+    {
+        Task task;
+        if (try_pop(task, only)) execute(task);
+        else std::this_thread::yield();
+    }
+
+    // The last job may still hold the lock
+    std::lock_guard<std::mutex> lock(counter.mutex);
+}
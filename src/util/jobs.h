@@ -0,0 +1,149 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using Job = std::function<void()>;
+
+class JobSystem;
+
+// Counts the jobs of a group that haven't finished yet
+// Wait on it with JobSystem::wait, or make jobs depend on it with run_after
+// A counter must outlive the jobs it counts, wait on it before destroying it
+class JobCounter
+{
+private:
+    friend class JobSystem;
+
+    struct Continuation
+    {
+        Job job;
+        JobCounter* counter;
+    };
+
+    std::atomic<size_t> pending = 0;
+
+    // Jobs started once pending reaches zero
+    std::mutex mutex;
+    std::vector<Continuation> continuations;
+public:
+    bool done() const { return pending.load() == 0; }
+};
+
+// Work stealing job scheduler
+// Every worker has its own deque, it runs its newest jobs first and steals
+// the oldest ones of the others when it runs out. Threads that aren't
+// workers push into a shared deque, and only run the jobs they wait on
+class JobSystem
+{
+private:
+    struct Task
+    {
+        Job job;
+        JobCounter* counter = nullptr;
+    };
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // One queue per worker, then the one shared by the other threads
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+
+    // Jobs in the queues, idle workers sleep until there are some
+    std::atomic<size_t> queued = 0;
+    std::atomic<bool> running = false;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+
+    void start(size_t worker_count);
+    void stop();
+
+    void worker_loop(size_t index);
+
+    // Pushes onto the calling thread's queue
+    void push(Task task);
+
+    // Pushes the task, or runs it right away if there are no workers
+    void schedule(Task task);
+
+    // Pops from the calling thread's queue or steals, false if all are empty
+    // With only set, just the tasks counted by it are taken
+    bool try_pop(Task& task, const JobCounter* only = nullptr);
+
+    // Runs the task and releases its counter
+    void execute(Task& task);
+
+    // A counted job finished, starts what depended on it once it reaches zero
+    void finish(JobCounter* counter);
+public:
+    // Workers default to one less than the cores, the calling thread is the
+    // last one (it runs jobs while waiting)
+    explicit JobSystem(size_t worker_count = default_worker_count());
+    JobSystem(const JobSystem& other) = delete;
+    JobSystem& operator=(const JobSystem& other) = delete;
+    ~JobSystem();
+
+    static size_t default_worker_count();
+
+    // Restarts the workers, queued jobs are finished first
+    // Only call it while no other thread is using the system
+    void set_worker_count(size_t worker_count);
+    size_t worker_count() const { return workers.size(); }
+
+    // Queue a job, the counter (if any) counts it until it has finished
+    void run(Job job, JobCounter* counter = nullptr);
+
+    // Queue a job once every job counted by dependency has finished
+    void run_after(JobCounter& dependency, Job job,
+        JobCounter* counter = nullptr);
+
+    // Runs jobs on the calling thread until the counter reaches zero
+    // Workers run any job, other threads only the ones counted by counter,
+    // so the render thread never picks up a long load while it waits
+    void wait(JobCounter& counter);
+
+    // Calls fn(begin, end) over [0, count) split into chunks of at least
+    // grain, spread over the workers, and waits for all of them
+    template <typename F>
+    void parallel_for(size_t count, size_t grain, F&& fn);
+};
+
+template <typename F>
+void JobSystem::parallel_for(size_t count, size_t grain, F&& fn)
+{
+    if (count == 0) return;
+
+    // A few chunks per thread so uneven chunks even out
+    size_t threads = workers.size() + 1;
+    size_t chunk = std::max(std::max<size_t>(grain, 1),
+        (count + threads * 4 - 1) / (threads * 4));
+    if (chunk >= count)
+    {
+        fn(size_t(0), count);
+        return;
+    }
+
+    JobCounter counter;
+    for (size_t begin = chunk; begin < count; begin += chunk)
+    {
+        size_t end = std::min(count, begin + chunk);
+        run([&fn, begin, end]() { fn(begin, end); }, &counter);
+    }
+
+    // The first chunk runs here, the others get stolen meanwhile
+    fn(size_t(0), chunk);
+    wait(counter);
+}
@@ -0,0 +1,125 @@
+#include "mapped_file.h"
+
+// std
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+{
+    *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+    if (this == &other) return *this;
+    close();
+    std::swap(ptr, other.ptr);
+    std::swap(length, other.length);
+#ifdef _WIN32
+    std::swap(file, other.file);
+    std::swap(mapping, other.mapping);
+#endif
+    return *this;
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string& path, uint32_t)
+{
+    close();
+
+    HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) return false;
+    file = handle;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(handle, &file_size) || file_size.QuadPart == 0)
+    {
+        close();
+        return false;
+    }
+
+    mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping)
+    {
+        close();
+        return false;
+    }
+
+    ptr = (const uint8_t*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!ptr)
+    {
+        close();
+        return false;
+    }
+    length = (size_t) file_size.QuadPart;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (ptr) UnmapViewOfFile(ptr);
+    if (mapping) CloseHandle(mapping);
+    if (file) CloseHandle(file);
+    ptr = nullptr;
+    length = 0;
+    mapping = nullptr;
+    file = nullptr;
+}
+
+#else
+
+bool MappedFile::open(const std::string& path, uint32_t hints)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    // The mapping keeps the file alive, the descriptor isn't needed after
+    void* mapped = mmap(nullptr, (size_t) info.st_size, PROT_READ,
+        MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) return false;
+
+    if (hints & SEQUENTIAL) 
+        posix_madvise(mapped, (size_t) info.st_size, POSIX_MADV_SEQUENTIAL);
+    if (hints & WILL_NEED) 
+        posix_madvise(mapped, (size_t) info.st_size, POSIX_MADV_WILLNEED);
+
+    ptr = (const uint8_t*) mapped;
+    length = (size_t) info.st_size;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (ptr) munmap((void*) ptr, length);
+    ptr = nullptr;
+    length = 0;
+}
+
+#endif
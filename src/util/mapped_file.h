@@ -0,0 +1,41 @@
+#pragma once
+
+// std
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Read only memory mapping of a whole file, unmapped when destroyed
+// The pages are loaded on first access, so only what is read costs I/O
+class MappedFile
+{
+private:
+    const uint8_t* ptr = nullptr;
+    size_t length = 0;
+
+#ifdef _WIN32
+    void* file = nullptr;
+    void* mapping = nullptr;
+#endif
+public:
+    // Access hints for the kernel, ignored where they aren't supported
+    // Sequential reads ahead aggressively and drops pages behind the reader, 
+    // will need starts reading the whole file in the background
+    static constexpr uint32_t SEQUENTIAL = 1;
+    static constexpr uint32_t WILL_NEED = 2;
+
+    MappedFile() = default;
+    MappedFile(const MappedFile& other) = delete;
+    MappedFile& operator=(const MappedFile& other) = delete;
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+    ~MappedFile();
+
+    // Maps the file, false if it can't be opened (or is empty)
+    bool open(const std::string& path, uint32_t hints = 0);
+    void close();
+
+    bool is_open() const { return ptr != nullptr; }
+    const uint8_t* data() const { return ptr; }
+    size_t size() const { return length; }
+};
@@ -0,0 +1,159 @@
+#include "range_allocator.h"
+
+// std
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+
+RangeAllocator::RangeAllocator()
+{
+    capacity = free_total = 0;
+}
+
+RangeAllocator::RangeAllocator(size_t capacity)
+{
+    this->capacity = free_total = capacity;
+    if (capacity) insert_free(0, capacity);
+}
+
+size_t RangeAllocator::allocate(size_t amount, size_t owner)
+{
+    // Zero sized ranges still need a unique offset to be freed by
+    if (amount == 0) amount = 1;
+
+    // Smallest free block that fits, lowest offset among equal sizes
+    auto best = free_by_size.lower_bound({amount, 0});
+    if (best == free_by_size.end()) return SIZE_MAX;
+
+    size_t offset = best->second;
+    size_t size = best->first;
+    erase_free(free_by_offset.find(offset));
+    if (size > amount) insert_free(offset + amount, size - amount);
+
+    allocations[offset] = {amount, owner};
+    free_total -= amount;
+    return offset;
+}
+
+bool RangeAllocator::allocate_at(size_t offset, size_t amount, size_t owner)
+{
+    if (amount == 0) amount = 1;
+
+    // Find the free block containing offset
+    auto block = free_by_offset.upper_bound(offset);
+    if (block == free_by_offset.begin()) return false;
+    block--;
+
+    size_t block_offset = block->first;
+    size_t block_size = block->second;
+    if (offset + amount > block_offset + block_size) return false;
+
+    erase_free(block);
+    if (offset > block_offset) 
+        insert_free(block_offset, offset - block_offset);
+    if (offset + amount < block_offset + block_size) 
+        insert_free(offset + amount, 
+            block_offset + block_size - offset - amount);
+
+    allocations[offset] = {amount, owner};
+    free_total -= amount;
+    return true;
+}
+
+void RangeAllocator::free(size_t offset)
+{
+    auto alloc = allocations.find(offset);
+    if (alloc == allocations.end()) 
+        throw std::runtime_error("Freeing a range that was never allocated");
+
+    size_t size = alloc->second.first;
+    allocations.erase(alloc);
+    free_total += size;
+
+    // Merge with the following free block
+    auto next = free_by_offset.find(offset + size);
+    if (next != free_by_offset.end())
+    {
+        size += next->second;
+        erase_free(next);
+    }
+
+    // Merge with the preceding free block
+    auto prev = free_by_offset.lower_bound(offset);
+    if (prev != free_by_offset.begin())
+    {
+        prev--;
+        if (prev->first + prev->second == offset)
+        {
+            offset = prev->first;
+            size += prev->second;
+            erase_free(prev);
+        }
+    }
+
+    insert_free(offset, size);
+}
+
+void RangeAllocator::grow(size_t new_capacity)
+{
+    if (new_capacity <= capacity) return;
+
+    size_t offset = capacity;
+    size_t size = new_capacity - capacity;
+    free_total += size;
+    capacity = new_capacity;
+
+    // Merge with the free block that ended at the old capacity
+    if (!free_by_offset.empty())
+    {
+        auto last = std::prev(free_by_offset.end());
+        if (last->first + last->second == offset)
+        {
+            offset = last->first;
+            size += last->second;
+            erase_free(last);
+        }
+    }
+
+    insert_free(offset, size);
+}
+
+size_t RangeAllocator::trailing_free_block() const
+{
+    if (free_by_offset.empty()) return 0;
+    auto last = free_by_offset.rbegin();
+    if (last->first + last->second != capacity) return 0;
+    return last->second;
+}
+
+size_t RangeAllocator::largest_free_block() const
+{
+    if (free_by_size.empty()) return 0;
+    return free_by_size.rbegin()->first;
+}
+
+Allocation RangeAllocator::first_free_block() const
+{
+    if (free_by_offset.empty()) return {SIZE_MAX, 0, SIZE_MAX};
+    return {free_by_offset.begin()->first, free_by_offset.begin()->second, 
+        SIZE_MAX};
+}
+
+Allocation RangeAllocator::next_allocation(size_t offset) const
+{
+    auto it = allocations.lower_bound(offset);
+    if (it == allocations.end()) return {SIZE_MAX, 0, SIZE_MAX};
+    return {it->first, it->second.first, it->second.second};
+}
+
+void RangeAllocator::insert_free(size_t offset, size_t size)
+{
+    free_by_offset[offset] = size;
+    free_by_size.insert({size, offset});
+}
+
+void RangeAllocator::erase_free(std::map<size_t, size_t>::iterator it)
+{
+    free_by_size.erase({it->second, it->first});
+    free_by_offset.erase(it);
+}
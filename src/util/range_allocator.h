@@ -0,0 +1,70 @@
+#pragma once
+
+// std
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <utility>
+
+// A live range inside of the allocator
+struct Allocation
+{
+    size_t offset;
+    size_t size;
+    size_t owner;
+};
+
+// Suballocates ranges out of a fixed number of units (vertices, indices, etc.)
+// Best fit over a size ordered free list, neighbouring free blocks are 
+// coalesced on free, so allocate and free are both O(log n)
+class RangeAllocator
+{
+private:
+    // Total number of units managed
+    size_t capacity;
+
+    // Number of units not allocated
+    size_t free_total;
+
+    // Free blocks keyed by offset (offset -> size), used for coalescing
+    std::map<size_t, size_t> free_by_offset;
+
+    // Free blocks keyed by size (size, offset), used for best fit lookups
+    std::set<std::pair<size_t, size_t>> free_by_size;
+
+    // Live allocations (offset -> size, owner)
+    std::map<size_t, std::pair<size_t, size_t>> allocations;
+public:
+    RangeAllocator();
+    explicit RangeAllocator(size_t capacity);
+
+    // Returns the offset of the allocated range, or SIZE_MAX if nothing fits
+    // The owner is an opaque tag handed back by next_allocation
+    size_t allocate(size_t amount, size_t owner = SIZE_MAX);
+
+    // Allocates a range at a fixed offset, fails if it isn't entirely free
+    bool allocate_at(size_t offset, size_t amount, size_t owner = SIZE_MAX);
+
+    // Frees a range previously returned by allocate
+    void free(size_t offset);
+
+    // Extends the managed range, merging with a free block at the end
+    void grow(size_t new_capacity);
+
+    // Queries (in units)
+    size_t get_capacity() const { return capacity; }
+    size_t free_space() const { return free_total; }
+    size_t largest_free_block() const;
+    size_t trailing_free_block() const;
+    size_t allocation_count() const { return allocations.size(); }
+
+    // Lowest free block, {SIZE_MAX, 0, SIZE_MAX} if there is none
+    Allocation first_free_block() const;
+
+    // First live allocation at or after offset, {SIZE_MAX, 0, SIZE_MAX} if none
+    Allocation next_allocation(size_t offset) const;
+private:
+    void insert_free(size_t offset, size_t size);
+    void erase_free(std::map<size_t, size_t>::iterator it);
+};
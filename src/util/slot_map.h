@@ -0,0 +1,84 @@
+#pragma once
+
+// std
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Stores values in reusable slots addressed by generational handles
+// A handle is the slot index in the low 32 bits and the generation of the 
+// slot in the high 32 bits, removing a value bumps the generation so stale 
+// handles are caught with a single compare instead of hitting a reused slot
+template <typename T>
+class SlotMap
+{
+private:
+    struct Slot
+    {
+        T value;
+        uint32_t generation = 0;
+        uint32_t next_free = UINT32_MAX;
+        bool alive = false;
+    };
+
+    std::vector<Slot> slots;
+
+    // Head of the list of removed slots to reuse
+    uint32_t free_head = UINT32_MAX;
+
+    // Number of live values
+    size_t count = 0;
+public:
+    // Returns the handle of the new value
+    size_t insert(const T& value)
+    {
+        uint32_t index;
+        if (free_head != UINT32_MAX)
+        {
+            index = free_head;
+            free_head = slots[index].next_free;
+        }
+        else
+        {
+            index = (uint32_t) slots.size();
+            slots.emplace_back();
+        }
+
+        Slot& slot = slots[index];
+        slot.value = value;
+        slot.alive = true;
+        slot.next_free = UINT32_MAX;
+        count++;
+        return ((size_t) slot.generation << 32) | index;
+    }
+
+    // Returns nullptr if the handle is stale or was never valid
+    T* get(size_t handle)
+    {
+        uint32_t index = (uint32_t) handle;
+        if (index >= slots.size()) return nullptr;
+        Slot& slot = slots[index];
+        if (!slot.alive || slot.generation != (uint32_t) (handle >> 32)) 
+            return nullptr;
+        return &slot.value;
+    }
+
+    bool contains(size_t handle) { return get(handle) != nullptr; }
+
+    // Returns false if the handle was already stale
+    bool remove(size_t handle)
+    {
+        if (!contains(handle)) return false;
+        uint32_t index = (uint32_t) handle;
+        Slot& slot = slots[index];
+        slot.alive = false;
+        slot.value = T();
+        slot.generation++;
+        slot.next_free = free_head;
+        free_head = index;
+        count--;
+        return true;
+    }
+
+    size_t size() const { return count; }
+};
@@ -1,6 +1,7 @@
 #include "util.h"
 
 // std
+#include <filesystem>
 #include <fstream>
 #include <stdexcept>
 #include <string>
@@ -37,6 +38,33 @@ bgfx::Memory* read_file_raw(const std::string& filepath)
     return data;
 }
 
+static void unmap_file(void*, void* file)
+{
+    delete (MappedFile*) file;
+}
+
+const bgfx::Memory* read_file_mapped(const std::string& filepath, 
+    uint32_t hints)
+{
+    MappedFile* file = new MappedFile();
+    if (!file->open(filepath, hints)) 
+    {
+        delete file;
+        throw std::runtime_error("Cannot find file " + filepath);
+    }
+
+    return bgfx::makeRef(file->data(), (uint32_t) file->size(), unmap_file, 
+        file);
+}
+
+int64_t file_mtime(const std::string& filepath)
+{
+    std::error_code error;
+    auto time = std::filesystem::last_write_time(filepath, error);
+    if (error) return 0;
+    return (int64_t) time.time_since_epoch().count();
+}
+
 void write_file(const std::string& filepath, const std::string& data)
 {
     std::ofstream file(filepath, std::ios_base::trunc);
@@ -1,12 +1,25 @@
 #pragma once
 
+// internal
+#include "util/mapped_file.h"
+
 // external
 #include <bx/bx.h>
 #include <bgfx/bgfx.h>
 
 // std
+#include <cstdint>
 #include <string>
 
 std::string read_file(const std::string& filepath);
 bgfx::Memory* read_file_raw(const std::string& filepath);
+
+// Maps the file and hands bgfx a reference to the mapping instead of a copy
+// The file is unmapped when bgfx releases the memory, so it has to be passed 
+// to bgfx. To only read a file, use a MappedFile
+const bgfx::Memory* read_file_mapped(const std::string& filepath, 
+    uint32_t hints = MappedFile::SEQUENTIAL | MappedFile::WILL_NEED);
+
+// Last modification time (in the file clock's units), 0 if it doesn't exist
+int64_t file_mtime(const std::string& filepath);
 void write_file(const std::string& filepath, const std::string& data);
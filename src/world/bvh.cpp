@@ -0,0 +1,294 @@
+#include "bvh.h"
+
+// std
+#include <algorithm>
+
+// Number of bins the centroids are sorted into when evaluating splits
+constexpr size_t SAH_BINS = 16;
+
+void Bvh::update(const BvhItem& item, const Aabb& box)
+{
+    auto existing = leaves.find(item);
+    if (existing != leaves.end())
+    {
+        // Refit only, the rebuild fixes the tree once it gets bad
+        nodes[existing->second].box = box;
+        refit(nodes[existing->second].parent);
+        changes++;
+        return;
+    }
+
+    int32_t leaf = allocate_node();
+    nodes[leaf].box = box;
+    nodes[leaf].item = item;
+    leaves[item] = leaf;
+    insert_leaf(leaf);
+    changes++;
+}
+
+void Bvh::remove(const BvhItem& item)
+{
+    auto existing = leaves.find(item);
+    if (existing == leaves.end()) return;
+
+    int32_t leaf = existing->second;
+    leaves.erase(existing);
+    remove_leaf(leaf);
+    free_node(leaf);
+    changes++;
+}
+
+void Bvh::rebuild()
+{
+    std::vector<Node> leaf_copies;
+    leaf_copies.reserve(leaves.size());
+    for (auto& [item, leaf] : leaves) leaf_copies.push_back(nodes[leaf]);
+
+    nodes.clear();
+    free_nodes.clear();
+    root = -1;
+
+    std::vector<int32_t> leaf_nodes;
+    leaf_nodes.reserve(leaf_copies.size());
+    for (Node& leaf : leaf_copies)
+    {
+        leaf.parent = leaf.left = leaf.right = -1;
+        leaves[leaf.item] = (int32_t) nodes.size();
+        leaf_nodes.push_back((int32_t) nodes.size());
+        nodes.push_back(leaf);
+    }
+
+    if (!leaf_nodes.empty()) root = build(leaf_nodes, 0, leaf_nodes.size());
+    built_cost = cost();
+    changes = 0;
+}
+
+void Bvh::maintain()
+{
+    if (changes == 0 || root < 0) return;
+    changes = 0;
+
+    float current = cost();
+    if (built_cost == 0.0f) built_cost = current;
+    if (current > built_cost * rebuild_ratio) rebuild();
+}
+
+float Bvh::cost() const
+{
+    if (root < 0) return 0.0f;
+
+    float area = 0.0f;
+    std::vector<int32_t> stack = {root};
+    while (!stack.empty())
+    {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+        if (node.leaf()) continue;
+
+        area += node.box.surface_area();
+        stack.push_back(node.left);
+        stack.push_back(node.right);
+    }
+
+    float root_area = nodes[root].box.surface_area();
+    return root_area > 0.0f ? area / root_area : 0.0f;
+}
+
+int32_t Bvh::allocate_node()
+{
+    if (!free_nodes.empty())
+    {
+        int32_t node = free_nodes.back();
+        free_nodes.pop_back();
+        nodes[node] = Node();
+        return node;
+    }
+
+    nodes.emplace_back();
+    return (int32_t) nodes.size() - 1;
+}
+
+void Bvh::free_node(int32_t node)
+{
+    free_nodes.push_back(node);
+}
+
+void Bvh::insert_leaf(int32_t leaf)
+{
+    if (root < 0)
+    {
+        root = leaf;
+        nodes[leaf].parent = -1;
+        return;
+    }
+
+    // Walk down to the sibling whose merged box adds the least area,
+    // a branch costs what it grows plus what every node above it grows
+    Aabb box = nodes[leaf].box;
+    int32_t sibling = root;
+    while (!nodes[sibling].leaf())
+    {
+        const Node& node = nodes[sibling];
+        float area = node.box.surface_area();
+        float merged_area = Aabb::merged(node.box, box).surface_area();
+
+        // Pairing with this node as a whole
+        float cost = 2.0f * merged_area;
+        float inherited = 2.0f * (merged_area - area);
+
+        auto child_cost = [&](int32_t child)
+        {
+            float merged = Aabb::merged(nodes[child].box, box).surface_area();
+            if (nodes[child].leaf()) return merged + inherited;
+            return merged - nodes[child].box.surface_area() + inherited;
+        };
+
+        float left_cost = child_cost(node.left);
+        float right_cost = child_cost(node.right);
+        if (cost < left_cost && cost < right_cost) break;
+        sibling = left_cost < right_cost ? node.left : node.right;
+    }
+
+    int32_t old_parent = nodes[sibling].parent;
+    int32_t parent = allocate_node();
+    nodes[parent].parent = old_parent;
+    nodes[parent].box = Aabb::merged(nodes[sibling].box, box);
+    nodes[parent].left = sibling;
+    nodes[parent].right = leaf;
+    nodes[sibling].parent = parent;
+    nodes[leaf].parent = parent;
+
+    if (old_parent < 0) root = parent;
+    else if (nodes[old_parent].left == sibling)
+        nodes[old_parent].left = parent;
+    else nodes[old_parent].right = parent;
+
+    refit(old_parent);
+}
+
+void Bvh::remove_leaf(int32_t leaf)
+{
+    if (leaf == root)
+    {
+        root = -1;
+        return;
+    }
+
+    int32_t parent = nodes[leaf].parent;
+    int32_t grand_parent = nodes[parent].parent;
+    int32_t sibling = nodes[parent].left == leaf ?
+        nodes[parent].right : nodes[parent].left;
+
+    nodes[sibling].parent = grand_parent;
+    if (grand_parent < 0) root = sibling;
+    else if (nodes[grand_parent].left == parent)
+        nodes[grand_parent].left = sibling;
+    else nodes[grand_parent].right = sibling;
+
+    free_node(parent);
+    refit(grand_parent);
+}
+
+void Bvh::refit(int32_t node)
+{
+    for (; node >= 0; node = nodes[node].parent)
+    {
+        nodes[node].box = Aabb::merged(nodes[nodes[node].left].box,
+            nodes[nodes[node].right].box);
+    }
+}
+
+int32_t Bvh::build(std::vector<int32_t>& leaf_nodes, size_t begin, size_t end)
+{
+    if (end - begin == 1) return leaf_nodes[begin];
+
+    Aabb bounds;
+    Aabb centroids;
+    for (size_t i = begin; i < end; i++)
+    {
+        const Aabb& box = nodes[leaf_nodes[i]].box;
+        bounds = Aabb::merged(bounds, box);
+        centroids = Aabb::merged(centroids, {box.center(), box.center()});
+    }
+
+    // Binned surface area heuristic over each axis, the split with the
+    // lowest area times count on both sides wins
+    size_t best_axis = 0;
+    size_t best_split = 0;
+    float best_cost = FLT_MAX;
+    glm::vec3 extent = centroids.max - centroids.min;
+    for (size_t axis = 0; axis < 3; axis++)
+    {
+        if (extent[axis] <= 0.0f) continue;
+
+        Aabb bins[SAH_BINS];
+        size_t counts[SAH_BINS] = {};
+        float scale = SAH_BINS / extent[axis];
+        for (size_t i = begin; i < end; i++)
+        {
+            const Aabb& box = nodes[leaf_nodes[i]].box;
+            size_t bin = std::min(SAH_BINS - 1, (size_t)
+                ((box.center()[axis] - centroids.min[axis]) * scale));
+            bins[bin] = Aabb::merged(bins[bin], box);
+            counts[bin]++;
+        }
+
+        // Right side areas and counts, swept from the end
+        float right_areas[SAH_BINS];
+        size_t right_counts[SAH_BINS];
+        Aabb right;
+        size_t right_count = 0;
+        for (size_t bin = SAH_BINS - 1; bin > 0; bin--)
+        {
+            right = Aabb::merged(right, bins[bin]);
+            right_count += counts[bin];
+            right_areas[bin] = right.surface_area();
+            right_counts[bin] = right_count;
+        }
+
+        Aabb left;
+        size_t left_count = 0;
+        for (size_t split = 1; split < SAH_BINS; split++)
+        {
+            left = Aabb::merged(left, bins[split - 1]);
+            left_count += counts[split - 1];
+            if (left_count == 0 || right_counts[split] == 0) continue;
+
+            float cost = left.surface_area() * left_count +
+                right_areas[split] * right_counts[split];
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = split;
+            }
+        }
+    }
+
+    // Split at the chosen bin, or in the middle if every centroid is equal
+    size_t middle = begin + (end - begin) / 2;
+    if (best_cost < FLT_MAX)
+    {
+        float scale = SAH_BINS / extent[best_axis];
+        auto split = std::partition(leaf_nodes.begin() + begin,
+            leaf_nodes.begin() + end, [&](int32_t leaf)
+        {
+            float center = nodes[leaf].box.center()[best_axis];
+            size_t bin = std::min(SAH_BINS - 1, (size_t)
+                ((center - centroids.min[best_axis]) * scale));
+            return bin < best_split;
+        });
+        middle = split - leaf_nodes.begin();
+    }
+
+    int32_t left = build(leaf_nodes, begin, middle);
+    int32_t right = build(leaf_nodes, middle, end);
+
+    int32_t node = allocate_node();
+    nodes[node].box = bounds;
+    nodes[node].left = left;
+    nodes[node].right = right;
+    nodes[left].parent = node;
+    nodes[right].parent = node;
+    return node;
+}
@@ -0,0 +1,270 @@
+#pragma once
+
+// internal
+#include "world/frustum.h"
+
+// external
+#include <glm/glm.hpp>
+#include <robin-hood/robin-hood.h>
+
+// std
+#include <cfloat>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Forward declaration of Batch
+class Batch;
+
+// Axis aligned bounding box
+struct Aabb
+{
+    glm::vec3 min = glm::vec3(FLT_MAX);
+    glm::vec3 max = glm::vec3(-FLT_MAX);
+
+    static Aabb from_sphere(const glm::vec3& center, float radius)
+    {
+        return {center - glm::vec3(radius), center + glm::vec3(radius)};
+    }
+
+    static Aabb merged(const Aabb& a, const Aabb& b)
+    {
+        return {glm::min(a.min, b.min), glm::max(a.max, b.max)};
+    }
+
+    glm::vec3 center() const { return (min + max) * 0.5f; }
+
+    float surface_area() const
+    {
+        glm::vec3 size = max - min;
+        return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+
+    bool contains(const Aabb& other) const
+    {
+        return min.x <= other.min.x && min.y <= other.min.y &&
+            min.z <= other.min.z && max.x >= other.max.x &&
+            max.y >= other.max.y && max.z >= other.max.z;
+    }
+};
+
+// A draw in the tree, the handle given out by the batch
+struct BvhItem
+{
+    Batch* batch = nullptr;
+    size_t draw = SIZE_MAX;
+
+    bool operator==(const BvhItem& other) const
+    {
+        return batch == other.batch && draw == other.draw;
+    }
+};
+
+struct BvhItemHash
+{
+    size_t operator()(const BvhItem& item) const
+    {
+        return robin_hood::hash_int((uint64_t) (uintptr_t) item.batch ^
+            ((uint64_t) item.draw * 0x9E3779B97F4A7C15ull));
+    }
+};
+
+// Dynamic AABB tree over the world space bounds of the uploaded models
+// Moving a model refits the boxes above it, which keeps the tree valid but
+// slowly worse, so it is rebuilt top down with the surface area heuristic
+// once its cost has grown by the rebuild ratio (see maintain)
+class Bvh
+{
+private:
+    struct Node
+    {
+        Aabb box;
+        int32_t parent = -1;
+        int32_t left = -1;
+        int32_t right = -1;
+        BvhItem item;
+
+        bool leaf() const { return left < 0; }
+    };
+
+    std::vector<Node> nodes;
+    std::vector<int32_t> free_nodes;
+    int32_t root = -1;
+
+    // Leaf node of each item
+    robin_hood::unordered_map<BvhItem, int32_t, BvhItemHash> leaves;
+
+    // Cost right after the last rebuild, and how much it may grow
+    float built_cost = 0.0f;
+    float rebuild_ratio = 1.5f;
+
+    // Changes since the cost was last checked
+    size_t changes = 0;
+public:
+    // Inserts the item, or moves it if it is already in the tree
+    void update(const BvhItem& item, const Aabb& box);
+    void remove(const BvhItem& item);
+    bool contains(const BvhItem& item) const { return leaves.count(item) != 0; }
+    size_t size() const { return leaves.size(); }
+
+    // Rebuilds the whole tree with the surface area heuristic
+    void rebuild();
+
+    // Rebuilds if the tree changed and its cost grew past the rebuild ratio
+    // Meant to be called once per frame
+    void maintain();
+    void set_rebuild_ratio(float ratio) { rebuild_ratio = ratio; }
+
+    // Surface area heuristic cost, the area of the inner nodes over the root's
+    float cost() const;
+
+    // Calls fn(item) for every item whose box intersects the query
+    template <typename F>
+    void query_frustum(const Frustum& frustum, F&& fn) const;
+    template <typename F>
+    void query_sphere(const glm::vec3& center, float radius, F&& fn) const;
+
+    // Calls fn(item, distance) for every box the ray enters within
+    // max_distance, distance is where it enters (0 if it starts inside)
+    // The direction doesn't need to be normalized, distances are in its units
+    template <typename F>
+    void query_ray(const glm::vec3& origin, const glm::vec3& direction,
+        float max_distance, F&& fn) const;
+private:
+    int32_t allocate_node();
+    void free_node(int32_t node);
+
+    // Links a leaf into the tree next to the sibling that grows the least
+    void insert_leaf(int32_t leaf);
+
+    // Unlinks a leaf, its sibling takes the place of their parent
+    void remove_leaf(int32_t leaf);
+
+    // Recomputes the boxes from node up to the root
+    void refit(int32_t node);
+
+    // Builds a subtree over leaf_nodes[begin, end), returns its root
+    int32_t build(std::vector<int32_t>& leaf_nodes, size_t begin, size_t end);
+
+    // Calls fn(item) for every leaf under node
+    template <typename F>
+    void for_each_leaf(int32_t node, F& fn) const;
+};
+
+template <typename F>
+void Bvh::for_each_leaf(int32_t node, F& fn) const
+{
+    std::vector<int32_t> stack = {node};
+    while (!stack.empty())
+    {
+        const Node& current = nodes[stack.back()];
+        stack.pop_back();
+        if (current.leaf()) fn(current.item);
+        else
+        {
+            stack.push_back(current.left);
+            stack.push_back(current.right);
+        }
+    }
+}
+
+template <typename F>
+void Bvh::query_frustum(const Frustum& frustum, F&& fn) const
+{
+    if (root < 0) return;
+
+    std::vector<int32_t> stack = {root};
+    while (!stack.empty())
+    {
+        int32_t index = stack.back();
+        const Node& node = nodes[index];
+        stack.pop_back();
+
+        // The corner furthest along each plane decides if the box is outside,
+        // the nearest one if it is fully inside
+        bool inside = true;
+        bool outside = false;
+        for (auto& plane : frustum.planes)
+        {
+            glm::vec3 normal(plane);
+            const Aabb& box = node.box;
+            glm::vec3 positive(normal.x >= 0.0f ? box.max.x : box.min.x,
+                normal.y >= 0.0f ? box.max.y : box.min.y,
+                normal.z >= 0.0f ? box.max.z : box.min.z);
+            glm::vec3 negative(normal.x >= 0.0f ? box.min.x : box.max.x,
+                normal.y >= 0.0f ? box.min.y : box.max.y,
+                normal.z >= 0.0f ? box.min.z : box.max.z);
+            if (glm::dot(normal, positive) + plane.w < 0.0f)
+            {
+                outside = true;
+                break;
+            }
+            if (glm::dot(normal, negative) + plane.w < 0.0f) inside = false;
+        }
+
+        if (outside) continue;
+        if (inside || node.leaf()) for_each_leaf(index, fn);
+        else
+        {
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+        }
+    }
+}
+
+template <typename F>
+void Bvh::query_sphere(const glm::vec3& center, float radius, F&& fn) const
+{
+    if (root < 0) return;
+
+    std::vector<int32_t> stack = {root};
+    while (!stack.empty())
+    {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+
+        glm::vec3 closest = glm::clamp(center, node.box.min, node.box.max);
+        glm::vec3 offset = center - closest;
+        if (glm::dot(offset, offset) > radius * radius) continue;
+
+        if (node.leaf()) fn(node.item);
+        else
+        {
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+        }
+    }
+}
+
+template <typename F>
+void Bvh::query_ray(const glm::vec3& origin, const glm::vec3& direction,
+    float max_distance, F&& fn) const
+{
+    if (root < 0) return;
+
+    // Division by zero gives infinities, which the slab test handles
+    glm::vec3 inverse = 1.0f / direction;
+
+    std::vector<int32_t> stack = {root};
+    while (!stack.empty())
+    {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+
+        glm::vec3 t0 = (node.box.min - origin) * inverse;
+        glm::vec3 t1 = (node.box.max - origin) * inverse;
+        glm::vec3 low = glm::min(t0, t1);
+        glm::vec3 high = glm::max(t0, t1);
+        float enter = glm::max(glm::max(low.x, low.y), glm::max(low.z, 0.0f));
+        float exit = glm::min(glm::min(high.x, high.y),
+            glm::min(high.z, max_distance));
+        if (enter > exit) continue;
+
+        if (node.leaf()) fn(node.item, enter);
+        else
+        {
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+        }
+    }
+}
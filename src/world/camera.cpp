@@ -1,5 +1,8 @@
 #include "camera.h"
 
+// external
+#include <bgfx/bgfx.h>
+
 Camera::Camera()
 {
     pitch = roll = yaw = 0;    
@@ -53,3 +56,9 @@ void Camera::movez(float amount)
 {
     eye += front * amount;
 }
+
+Frustum Camera::get_frustum(const glm::mat4& projection)
+{
+    return Frustum::from_matrix(projection * get_view(), 
+        bgfx::getCaps()->homogeneousDepth);
+}
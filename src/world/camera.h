@@ -1,5 +1,8 @@
 #pragma once
 
+// internal
+#include "world/frustum.h"
+
 // external
 #include "glm/ext/matrix_transform.hpp"
 #include <glm/glm.hpp>
@@ -38,4 +41,9 @@ public:
         view = glm::lookAt(eye, eye + front, up); 
         return view;
     }
+
+    glm::vec3 get_eye() { return eye; }
+
+    // Frustum of the camera for culling, in world space
+    Frustum get_frustum(const glm::mat4& projection);
 };
@@ -0,0 +1,53 @@
+#include "frustum.h"
+
+Frustum Frustum::from_matrix(const glm::mat4& view_proj, bool homogeneous_depth)
+{
+    // Rows of the matrix, glm is column major
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; i++)
+    {
+        rows[i] = glm::vec4(view_proj[0][i], view_proj[1][i], view_proj[2][i],
+            view_proj[3][i]);
+    }
+
+    Frustum frustum;
+    frustum.planes[0] = rows[3] + rows[0];
+    frustum.planes[1] = rows[3] - rows[0];
+    frustum.planes[2] = rows[3] + rows[1];
+    frustum.planes[3] = rows[3] - rows[1];
+    frustum.planes[4] = homogeneous_depth ? rows[3] + rows[2] : rows[2];
+    frustum.planes[5] = rows[3] - rows[2];
+
+    // Normalized so the distance to a plane can be compared with a radius
+    for (auto& plane : frustum.planes)
+    {
+        plane = plane / glm::length(glm::vec3(plane));
+    }
+
+    return frustum;
+}
+
+Frustum Frustum::infinite()
+{
+    Frustum frustum;
+    for (auto& plane : frustum.planes) plane = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    return frustum;
+}
+
+bool Frustum::contains(const glm::vec3& center, float radius) const
+{
+    for (auto& plane : planes)
+    {
+        if (glm::dot(glm::vec3(plane), center) + plane.w < -radius) return false;
+    }
+    return true;
+}
+
+bool Frustum::operator==(const Frustum& other) const
+{
+    for (int i = 0; i < 6; i++)
+    {
+        if (planes[i] != other.planes[i]) return false;
+    }
+    return true;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+// external
+#include <glm/glm.hpp>
+
+// View frustum as six planes (normal, distance) with the normals pointing in
+// A point p is inside when dot(normal, p) + distance >= 0 for every plane
+struct Frustum
+{
+    glm::vec4 planes[6];
+
+    // Planes of a view projection matrix (projection * view gives world space)
+    // Homogeneous depth is bgfx::getCaps()->homogeneousDepth, the -1 to 1 range
+    static Frustum from_matrix(const glm::mat4& view_proj,
+        bool homogeneous_depth);
+
+    // Planes that every sphere is inside of, for views that aren't culled
+    static Frustum infinite();
+
+    // If the sphere is at least partially inside
+    bool contains(const glm::vec3& center, float radius) const;
+
+    bool operator==(const Frustum& other) const;
+    bool operator!=(const Frustum& other) const { return !(*this == other); }
+};